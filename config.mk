@@ -7,9 +7,10 @@ MANPREFIX = ${PREFIX}/share/man
 # includes and libs
 INCS = -I.
 LIBS = -L/usr/lib
+PTHREAD_LIBS = -lpthread
 
 # flags
-CPPFLAGS = -DVERSION=\"${VERSION}\" -D_XOPEN_SOURCE=600
+CPPFLAGS = -DVERSION=\"${VERSION}\" -D_XOPEN_SOURCE=700
 CFLAGS += -g -std=c99 -pedantic -Wall ${INCS} ${CPPFLAGS}
 LDFLAGS += -g ${LIBS}
 
@@ -174,27 +174,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
-#include "util.h"
 #include "miniz.h" // Include miniz for ZIP handling
-
-#define TXML_DEFINE
 #include "txml.h"  // Include txml for XML parsing
+#include "doctxt.h"
+#include "util.h"
 
 #define LEN(a)		sizeof(a) / sizeof(a[0]) 
-#define TEMPFILE	"/tmp/doctxt-temp.txt" 
-
-void
-writetofile(char *out_file_path, char *data)
-{
-	FILE *out_file;
-	out_file = fopen(out_file_path, "w");
-	fprintf(out_file, "%s", data);
-	fclose(out_file);
-}
+#define PREVIEW_BLOCK	(64 * 1024)
 
-char *xml_unescape(const char *in) {
-    char *out = malloc(strlen(in) * 2); // generous size
+static char *xml_unescape(doctxt_ctx *ctx, const char *in) {
+    char *out = arena_alloc(ctx, strlen(in) + 1); // never longer than input
     if (!out) {
         return NULL;
     }
@@ -225,53 +216,18 @@ char *xml_unescape(const char *in) {
     return out;
 }
 
-int
-readzip(const char *path, char *filename)
-{
-	// Open the zip file using miniz
-	mz_zip_archive zip;
-	memset(&zip, 0, sizeof(zip));
-	if (!mz_zip_reader_init_file(&zip, path, 0)) {
-		die("Unable to open zip: %s", path);
-	}
-
-	// Find the file inside the zip archive
-	int file_index = mz_zip_reader_locate_file(&zip, filename, NULL, 0);
-	if (file_index < 0) {
-		mz_zip_reader_end(&zip);
-		return 0; // File not found
-	}
-
-	// Extract the file to memory
-	size_t file_size;
-	void *file_data = mz_zip_reader_extract_to_heap(&zip, file_index, &file_size, 0);
-	if (!file_data) {
-		mz_zip_reader_end(&zip);
-		die("Failed to extract file from zip");
-	}
-
-	// Write the extracted content to the temporary file
-	writetofile(TEMPFILE, (char *)file_data);
-
-	// Clean up
-	mz_free(file_data);
-	mz_zip_reader_end(&zip);
-	return 1; // Success
-}
-
-void extract_text_nodes(struct txml_node *parent, FILE *outfile)
+static void extract_text_nodes(struct txml_node *parent, doctxt_ctx *ctx)
 {
     struct txml_node *node_t = NULL;
     while ((node_t = txml_find(parent, node_t, TXML_ELEMENT, "w:t", NULL, 1))) {
-        char *text = node_t->value ? xml_unescape(node_t->value) : NULL;
+        char *text = node_t->value ? xml_unescape(ctx, node_t->value) : NULL;
         if (text) {
-            fprintf(outfile, "%s", text);
-            free(text);
+            out_puts(ctx, text);
         }
     }
 }
 
-void extract_table(struct txml_node *table, FILE *outfile)
+static void extract_table(struct txml_node *table, doctxt_ctx *ctx)
 {
     struct txml_node *row = NULL;
     
@@ -283,75 +239,72 @@ void extract_table(struct txml_node *table, FILE *outfile)
         // Traverse all table cells (w:tc) in the row
         while ((cell = txml_find(row, cell, TXML_ELEMENT, "w:tc", NULL, 0))) {
             if (!first_cell) {
-                fprintf(outfile, "\t");
+                out_puts(ctx, "\t");
             }
             first_cell = 0;
             
             // Extract all paragraphs in the cell
             struct txml_node *para = NULL;
             int first_para = 1;
-            int has_content = 0;
             while ((para = txml_find(cell, para, TXML_ELEMENT, "w:p", NULL, 0))) {
                 if (!first_para) {
-                    fprintf(outfile, " ");
+                    out_puts(ctx, " ");
                 }
                 first_para = 0;
-                extract_text_nodes(para, outfile);
-                has_content = 1;
+                extract_text_nodes(para, ctx);
             }
             // Empty cells are represented by nothing between tabs (handled by separator logic)
         }
-        fprintf(outfile, "\n");
+        out_puts(ctx, "\n");
     }
 }
 
-void parsexml(char *path, FILE *outfile)
+// Extract the paragraphs and tables directly below parent
+static void extract_blocks(struct txml_node *parent, doctxt_ctx *ctx)
 {
-    struct txml_node *nodes = NULL;
-
-    // Parse the XML data
-    char *xml_data = txml_parse_file(path, &nodes);
-    if (!xml_data) {
-    	die("Error reading XML");
-    }
-
-    // Find the body node
-    struct txml_node *node_body = NULL;
-    node_body = txml_find(nodes, node_body, TXML_ELEMENT, "w:body", NULL, 1);
-    if (!node_body) {
-        die("No body element found in XML");
-    }
-
-    // Process paragraphs and tables
     // Note: Due to txml API limitations, we extract paragraphs first, then tables.
     // This may not preserve the exact document order if tables and paragraphs are interleaved.
     // For most documents this is acceptable as tables are typically grouped.
     struct txml_node *node_p = NULL, *node_tbl = NULL;
     
     // First, extract all paragraphs
-    while ((node_p = txml_find(node_body, node_p, TXML_ELEMENT, "w:p", NULL, 0))) {
-        extract_text_nodes(node_p, outfile);
-        fprintf(outfile, "\n");
+    while (!ctx->err && (node_p = txml_find(parent, node_p, TXML_ELEMENT, "w:p", NULL, 0))) {
+        extract_text_nodes(node_p, ctx);
+        out_puts(ctx, "\n");
     }
     
     // Then extract all tables
-    while ((node_tbl = txml_find(node_body, node_tbl, TXML_ELEMENT, "w:tbl", NULL, 0))) {
-        extract_table(node_tbl, outfile);
+    while (!ctx->err && (node_tbl = txml_find(parent, node_tbl, TXML_ELEMENT, "w:tbl", NULL, 0))) {
+        extract_table(node_tbl, ctx);
     }
-
-    // Clean up the allocated memory for nodes and XML data
-    free(nodes);
-    free(xml_data);
 }
 
-void parsecomments(char *path, FILE *outfile)
+static int parsexml(char *xml, size_t size, doctxt_ctx *ctx)
 {
-    struct txml_node *nodes = NULL;
+    // Parse the XML data in place
+    struct txml_node *nodes = dt_parse_xml(ctx, xml, size);
+    if (!nodes) {
+        return dt_error(ctx, DOCTXT_EXML, "Error reading XML");
+    }
 
-    // Parse the XML data
-    char *xml_data = txml_parse_file(path, &nodes);
-    if (!xml_data) {
-        // No comments file exists - silently return
+    // Find the body node
+    struct txml_node *node_body = NULL;
+    node_body = txml_find(nodes, node_body, TXML_ELEMENT, "w:body", NULL, 1);
+    if (!node_body) {
+        return dt_error(ctx, DOCTXT_EXML, "No body element found in XML");
+    }
+
+    // Process paragraphs and tables
+    extract_blocks(node_body, ctx);
+    return ctx->err;
+}
+
+static void parsecomments(char *xml, size_t size, doctxt_ctx *ctx)
+{
+    // Parse the XML data in place
+    struct txml_node *nodes = dt_parse_xml(ctx, xml, size);
+    if (!nodes) {
+        // Unreadable comments are skipped silently
         return;
     }
 
@@ -360,39 +313,575 @@ void parsecomments(char *path, FILE *outfile)
     comments_root = txml_find(nodes, NULL, TXML_ELEMENT, "w:comments", NULL, 0);
     if (!comments_root) {
         // No comments element found
-        free(nodes);
-        free(xml_data);
         return;
     }
 
     // Find all comment nodes within the comments element
     struct txml_node *comment = NULL;
-    while ((comment = txml_find(comments_root, comment, TXML_ELEMENT, "w:comment", NULL, 0))) {
+    while (!ctx->err && (comment = txml_find(comments_root, comment, TXML_ELEMENT, "w:comment", NULL, 0))) {
         // Get comment author
         struct txml_node *author_attr = txml_find(comment, NULL, TXML_ATTRIBUTE, "w:author", NULL, 0);
         if (author_attr && author_attr->value) {
-            fprintf(outfile, "[%s]: ", author_attr->value);
+            out_printf(ctx, "[%s]: ", author_attr->value);
         } else {
-            fprintf(outfile, "[Unknown]: ");
+            out_puts(ctx, "[Unknown]: ");
         }
         
         // Extract text from all paragraphs in the comment
         struct txml_node *para = NULL;
         while ((para = txml_find(comment, para, TXML_ELEMENT, "w:p", NULL, 0))) {
-            extract_text_nodes(para, outfile);
+            extract_text_nodes(para, ctx);
+        }
+        out_puts(ctx, "\n");
+    }
+}
+
+// Headers and footers hold paragraphs and tables like the body
+static void parseheader(char *xml, size_t size, const char *root, doctxt_ctx *ctx)
+{
+    struct txml_node *nodes = dt_parse_xml(ctx, xml, size);
+    if (!nodes) {
+        // Unreadable parts other than the body are skipped silently
+        return;
+    }
+    struct txml_node *node_root = txml_find(nodes, NULL, TXML_ELEMENT, root, NULL, 0);
+    if (node_root) {
+        extract_blocks(node_root, ctx);
+    }
+}
+
+// Footnotes and endnotes, one line per note; separators are skipped
+static void parsenotes(char *xml, size_t size, const char *root, const char *tag, doctxt_ctx *ctx)
+{
+    struct txml_node *nodes = dt_parse_xml(ctx, xml, size);
+    if (!nodes) {
+        return;
+    }
+    struct txml_node *notes_root = txml_find(nodes, NULL, TXML_ELEMENT, root, NULL, 0);
+    if (!notes_root) {
+        return;
+    }
+
+    struct txml_node *note = NULL;
+    while (!ctx->err && (note = txml_find(notes_root, note, TXML_ELEMENT, tag, NULL, 0))) {
+        struct txml_node *type_attr = txml_find(note, NULL, TXML_ATTRIBUTE, "w:type", NULL, 0);
+        if (type_attr && type_attr->value && strcmp(type_attr->value, "normal") != 0) {
+            continue;
+        }
+        struct txml_node *id_attr = txml_find(note, NULL, TXML_ATTRIBUTE, "w:id", NULL, 0);
+        out_printf(ctx, "[%s]: ", id_attr && id_attr->value ? id_attr->value : "?");
+
+        struct txml_node *para = NULL;
+        int first_para = 1;
+        while ((para = txml_find(note, para, TXML_ELEMENT, "w:p", NULL, 0))) {
+            if (!first_para) {
+                out_puts(ctx, " ");
+            }
+            first_para = 0;
+            extract_text_nodes(para, ctx);
+        }
+        out_puts(ctx, "\n");
+    }
+}
+
+// Parts read by DOCTXT_ALL_PARTS, in output order
+enum part_kind {
+    PART_BODY,
+    PART_HEADER,
+    PART_FOOTER,
+    PART_FOOTNOTES,
+    PART_ENDNOTES,
+    PART_COMMENTS,
+    PART_NONE
+};
+
+// headerN.xml and footerN.xml directly in word/
+static int isnumbered(const char *name, const char *prefix)
+{
+    size_t len = strlen(prefix);
+
+    if (strncmp(name, prefix, len)) {
+        return 0;
+    }
+    name += len;
+    while (*name >= '0' && *name <= '9') {
+        name++;
+    }
+    return !strcmp(name, ".xml");
+}
+
+static enum part_kind partkind(const char *name)
+{
+    if (strncmp(name, "word/", 5)) {
+        return PART_NONE;
+    }
+    name += 5;
+    if (!strcmp(name, "document.xml")) {
+        return PART_BODY;
+    }
+    if (isnumbered(name, "header")) {
+        return PART_HEADER;
+    }
+    if (isnumbered(name, "footer")) {
+        return PART_FOOTER;
+    }
+    if (!strcmp(name, "footnotes.xml")) {
+        return PART_FOOTNOTES;
+    }
+    if (!strcmp(name, "endnotes.xml")) {
+        return PART_ENDNOTES;
+    }
+    if (!strcmp(name, "comments.xml")) {
+        return PART_COMMENTS;
+    }
+    return PART_NONE;
+}
+
+// Every text part of the archive as a labelled section, from one scan of
+// the central directory
+static void allparts(mz_zip_archive *zip, doctxt_ctx *ctx)
+{
+    char name[MZ_ZIP_MAX_ARCHIVE_FILENAME_SIZE];
+    unsigned char *kinds;
+    mz_uint i, n = mz_zip_reader_get_num_files(zip);
+    size_t xml_size;
+    char *xml;
+    int k;
+
+    if (!(kinds = arena_alloc(ctx, n + 1))) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        mz_zip_reader_get_filename(zip, i, name, sizeof(name));
+        kinds[i] = partkind(name);
+    }
+
+    for (k = PART_BODY; k < PART_NONE && !ctx->err; k++) {
+        for (i = 0; i < n && !ctx->err; i++) {
+            if (kinds[i] != k) {
+                continue;
+            }
+            if (!(xml = dt_zip_entry(ctx, zip, i, &xml_size))) {
+                break;
+            }
+            mz_zip_reader_get_filename(zip, i, name, sizeof(name));
+            out_printf(ctx, "=== %s ===\n", name + 5);
+            switch (k) {
+            case PART_BODY:
+                parsexml(xml, xml_size, ctx);
+                break;
+            case PART_HEADER:
+                parseheader(xml, xml_size, "w:hdr", ctx);
+                break;
+            case PART_FOOTER:
+                parseheader(xml, xml_size, "w:ftr", ctx);
+                break;
+            case PART_FOOTNOTES:
+                parsenotes(xml, xml_size, "w:footnotes", "w:footnote", ctx);
+                break;
+            case PART_ENDNOTES:
+                parsenotes(xml, xml_size, "w:endnotes", "w:endnote", ctx);
+                break;
+            case PART_COMMENTS:
+                parsecomments(xml, xml_size, ctx);
+                break;
+            }
+            out_puts(ctx, "\n");
+        }
+        if (k == PART_BODY && !memchr(kinds, PART_BODY, n)) {
+            dt_error(ctx, DOCTXT_ENOPART, "File not found in zip: word/document.xml");
+        }
+    }
+}
+
+// Text of the first element called name as one field of a record
+static void out_field(struct txml_node *nodes, const char *name, doctxt_ctx *ctx)
+{
+    struct txml_node *node = nodes ? txml_find(nodes, NULL, TXML_ELEMENT, name, NULL, 1) : NULL;
+    char *text = node && node->value ? xml_unescape(ctx, node->value) : NULL;
+    if (text) {
+        for (char *p = text; *p; p++) {
+            if (*p == '\t' || *p == '\n' || *p == '\r') {
+                *p = ' ';
+            }
+        }
+        out_puts(ctx, text);
+    }
+    out_puts(ctx, "\t");
+}
+
+// Catalog record from the document properties and the central directory;
+// document.xml is only looked up, never inflated
+static void parsemeta(mz_zip_archive *zip, doctxt_ctx *ctx)
+{
+    struct txml_node *core = NULL, *app = NULL;
+    mz_zip_archive_file_stat st;
+    mz_uint64 total = 0;
+    size_t xml_size;
+    char *xml;
+
+    // Missing or unreadable properties leave their fields empty
+    if ((xml = dt_zip_part(ctx, zip, "docProps/core.xml", &xml_size))) {
+        core = dt_parse_xml(ctx, xml, xml_size);
+    }
+    if ((xml = dt_zip_part(ctx, zip, "docProps/app.xml", &xml_size))) {
+        app = dt_parse_xml(ctx, xml, xml_size);
+    }
+    out_field(core, "dc:title", ctx);
+    out_field(core, "dc:creator", ctx);
+    out_field(core, "dcterms:modified", ctx);
+    out_field(app, "Pages", ctx);
+    out_field(app, "Words", ctx);
+    out_field(app, "Characters", ctx);
+
+    mz_uint n = mz_zip_reader_get_num_files(zip);
+    for (mz_uint i = 0; i < n; i++) {
+        if (mz_zip_reader_file_stat(zip, i, &st)) {
+            total += st.m_uncomp_size;
+        }
+    }
+    out_printf(ctx, "%llu\t", (unsigned long long)total);
+    int i = mz_zip_reader_locate_file(zip, "word/document.xml", NULL, 0);
+    if (i >= 0 && mz_zip_reader_file_stat(zip, i, &st)) {
+        out_printf(ctx, "%08lx", (unsigned long)st.m_crc32);
+    }
+    out_puts(ctx, "\n");
+}
+
+// Element left open in the preview scan, as an offset into the buffer
+struct open_tag {
+    size_t off;
+    size_t len;
+};
+
+// A preview inflates the body a block at a time and scans each block for
+// tags, so it can stop as soon as it has enough text; the cut document is
+// then closed and parsed as usual, and costs the same however long the
+// full document is
+struct preview {
+    char *buf;
+    size_t len;             // inflated bytes
+    size_t cap;
+    size_t pos;             // scanned up to here, always between tags
+    struct open_tag *stack;
+    size_t depth;
+    size_t stackcap;
+    size_t body;            // depth of w:body, 0 until it is open
+    size_t chars;           // text of body paragraphs seen so far
+    size_t paras;
+};
+
+static int tag_is(const struct preview *pv, size_t depth, const char *name)
+{
+    if (depth == 0) {
+        return 0;
+    }
+    const struct open_tag *t = &pv->stack[depth - 1];
+    return t->len == strlen(name) && !memcmp(pv->buf + t->off, name, t->len);
+}
+
+// End of the markup starting at lt, or NULL when it is not complete yet
+static const char *markup_end(const char *lt, const char *end)
+{
+    if (end - lt >= 4 && !memcmp(lt, "<!--", 4)) {
+        for (const char *p = lt + 4; end - p >= 3; p++) {
+            if (!memcmp(p, "-->", 3)) {
+                return p + 2;
+            }
+        }
+        return NULL;
+    }
+    // Attribute values may contain '>'
+    char quote = 0;
+    for (const char *p = lt + 1; p < end; p++) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '>') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Characters of text in [p, end), entities counting as one
+static size_t count_chars(const char *p, const char *end)
+{
+    size_t n = 0;
+    while (p < end) {
+        if (*p == '&') {
+            const char *semi = memchr(p, ';', end - p);
+            p = semi ? semi + 1 : end;
+            n++;
+        } else if ((*p++ & 0xC0) != 0x80) {
+            n++;
         }
-        fprintf(outfile, "\n");
     }
+    return n;
+}
+
+// Whether text at the top of the stack is output: like extract_blocks(),
+// only the w:t inside paragraphs directly in the body count, so content
+// controls and tables (which come last) do not
+static int in_body_text(const struct preview *pv)
+{
+    return pv->body && pv->depth > pv->body + 1 && tag_is(pv, pv->body + 1, "w:p") &&
+           tag_is(pv, pv->depth, "w:t");
+}
+
+// Scan the complete tags inflated so far; returns 1 once the preview has
+// enough text
+static int preview_scan(struct preview *pv, size_t max_chars, size_t max_paras, doctxt_ctx *ctx)
+{
+    const char *end = pv->buf + pv->len;
+
+    while (pv->pos < pv->len) {
+        const char *p = pv->buf + pv->pos;
+        const char *lt = memchr(p, '<', end - p);
+        const char *gt = lt ? markup_end(lt, end) : NULL;
+        if (!gt) {
+            return 0;
+        }
+        if (in_body_text(pv)) {
+            pv->chars += count_chars(p, lt);
+        }
 
-    // Clean up the allocated memory for nodes and XML data
-    free(nodes);
-    free(xml_data);
+        if (lt[1] == '/') {
+            if (pv->depth > 0) {
+                if (pv->body && pv->depth == pv->body + 1 && tag_is(pv, pv->depth, "w:p")) {
+                    pv->paras++;
+                }
+                pv->depth--;
+            }
+        } else if (lt[1] != '?' && lt[1] != '!') {
+            size_t len = strcspn(lt + 1, " \t\r\n/>");
+            int empty = gt[-1] == '/';
+            if (pv->depth == pv->stackcap) {
+                size_t cap = pv->stackcap ? pv->stackcap * 2 : 64;
+                pv->stack = arena_grow(ctx, pv->stack, pv->stackcap * sizeof(*pv->stack),
+                                       cap * sizeof(*pv->stack));
+                if (!pv->stack) {
+                    return 1;
+                }
+                pv->stackcap = cap;
+            }
+            pv->stack[pv->depth].off = lt + 1 - pv->buf;
+            pv->stack[pv->depth].len = len;
+            pv->depth++;
+            if (!pv->body && tag_is(pv, pv->depth, "w:body")) {
+                pv->body = pv->depth;
+            } else if (empty && pv->body && pv->depth == pv->body + 1 && tag_is(pv, pv->depth, "w:p")) {
+                pv->paras++;
+            }
+            if (empty) {
+                pv->depth--;
+            }
+        }
+        pv->pos = gt + 1 - pv->buf;
+
+        if ((max_chars && pv->chars >= max_chars) || (max_paras && pv->paras >= max_paras)) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void
+// Keep the first max_chars characters and max_paras lines of the output
+static void trim_output(doctxt_ctx *ctx, size_t max_chars, size_t max_paras)
+{
+    size_t chars = 0, lines = 0;
+
+    for (size_t i = 0; i < ctx->outlen; i++) {
+        if ((ctx->out[i] & 0xC0) != 0x80 && max_chars && chars++ == max_chars) {
+            ctx->outlen = i;
+            return;
+        }
+        if (ctx->out[i] == '\n' && max_paras && ++lines == max_paras) {
+            ctx->outlen = i + 1;
+            return;
+        }
+    }
+}
+
+static void parsepreview(mz_zip_archive *zip, size_t max_chars, size_t max_paras, doctxt_ctx *ctx)
+{
+    struct preview pv = {0};
+    int i, enough = 0, complete = 0;
+
+    if ((i = mz_zip_reader_locate_file(zip, "word/document.xml", NULL, 0)) < 0) {
+        dt_error(ctx, DOCTXT_ENOPART, "File not found in zip: word/document.xml");
+        return;
+    }
+    mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(zip, i, 0);
+    if (!iter) {
+        dt_error(ctx, DOCTXT_EZIP, "Failed to extract word/document.xml");
+        return;
+    }
+
+    while (!enough && !ctx->err) {
+        if (pv.cap - pv.len < PREVIEW_BLOCK + 1) {
+            size_t cap = MAX(pv.cap * 2, pv.len + PREVIEW_BLOCK + 1);
+            if (!(pv.buf = arena_grow(ctx, pv.buf, pv.cap, cap))) {
+                break;
+            }
+            pv.cap = cap;
+        }
+        size_t n = mz_zip_reader_extract_iter_read(iter, pv.buf + pv.len, PREVIEW_BLOCK);
+        if (n == 0) {
+            complete = 1;
+            break;
+        }
+        pv.len += n;
+        enough = preview_scan(&pv, max_chars, max_paras, ctx);
+    }
+    // A part read only in part can not have its CRC checked
+    if (!mz_zip_reader_extract_iter_free(iter) && complete) {
+        dt_error(ctx, DOCTXT_EZIP, "Failed to extract word/document.xml");
+    }
+    if (ctx->err) {
+        return;
+    }
+
+    if (enough) {
+        // Cut after the last tag scanned and close what is still open
+        size_t len = pv.pos;
+        for (size_t d = 0; d < pv.depth; d++) {
+            len += pv.stack[d].len + 3;
+        }
+        if (len >= pv.cap && !(pv.buf = arena_grow(ctx, pv.buf, pv.cap, len + 1))) {
+            return;
+        }
+        pv.len = pv.pos;
+        while (pv.depth > 0) {
+            struct open_tag *t = &pv.stack[--pv.depth];
+            pv.buf[pv.len++] = '<';
+            pv.buf[pv.len++] = '/';
+            memmove(pv.buf + pv.len, pv.buf + t->off, t->len);
+            pv.len += t->len;
+            pv.buf[pv.len++] = '>';
+        }
+    }
+    pv.buf[pv.len] = '\0';
+
+    if (parsexml(pv.buf, pv.len, ctx) == DOCTXT_OK) {
+        trim_output(ctx, max_chars, max_paras);
+    }
+}
+
+int
+doctxt_docx_preview(doctxt_ctx *ctx, const void *docx, size_t size,
+                    size_t max_chars, size_t max_paragraphs,
+                    const char **out, size_t *outsize)
+{
+	dt_begin(ctx);
+
+	mz_zip_archive zip;
+	memset(&zip, 0, sizeof(zip));
+	DT_ZIP_ALLOC(&zip, ctx);
+	if (!mz_zip_reader_init_mem(&zip, docx, size, 0)) {
+		dt_error(ctx, DOCTXT_EZIP, "Unable to open zip");
+		return dt_end(ctx, out, outsize);
+	}
+	parsepreview(&zip, max_chars, max_paragraphs, ctx);
+	mz_zip_reader_end(&zip);
+	return dt_end(ctx, out, outsize);
+}
+
+int
+doctxt_docx_to_txt(doctxt_ctx *ctx, const void *docx, size_t size, int flags,
+                   const char **out, size_t *outsize)
+{
+	char *xml;
+	size_t xml_size;
+
+	dt_begin(ctx);
+
+	// Open the zip file using miniz
+	mz_zip_archive zip;
+	memset(&zip, 0, sizeof(zip));
+	DT_ZIP_ALLOC(&zip, ctx);
+	if (!mz_zip_reader_init_mem(&zip, docx, size, 0)) {
+		dt_error(ctx, DOCTXT_EZIP, "Unable to open zip");
+		return dt_end(ctx, out, outsize);
+	}
+
+	if (flags & DOCTXT_METADATA) {
+		parsemeta(&zip, ctx);
+	} else if (flags & DOCTXT_ALL_PARTS) {
+		allparts(&zip, ctx);
+	} else if (flags & DOCTXT_COMMENTS) {
+		// Extract only comments
+		if ((xml = dt_zip_part(ctx, &zip, "word/comments.xml", &xml_size)))
+			parsecomments(xml, xml_size, ctx);
+		// If no comments file, output will be empty
+	} else {
+		// Extract document content (text and tables)
+		if ((xml = dt_zip_part(ctx, &zip, "word/document.xml", &xml_size)))
+			parsexml(xml, xml_size, ctx);
+		else
+			dt_error(ctx, DOCTXT_ENOPART, "File not found in zip: word/document.xml");
+	}
+
+	mz_zip_reader_end(&zip);
+	return dt_end(ctx, out, outsize);
+}
+
+#ifndef DOCTXT_LIB
+static void
 usage()
 {
-	die("usage: doctxt infile [-o outfile] [-c]");
+	die("usage: doctxt infile [-o outfile] [-c | -a] [--max-chars n] [--max-paragraphs n]\n"
+	    "       doctxt -m [infile ...] [-o outfile]");
+}
+
+/* append the catalog record of one file to fp; failures are reported and
+ * the batch goes on */
+static int
+catalog(doctxt_ctx *ctx, const char *path, FILE *fp)
+{
+	const char *data, *out;
+	size_t size, outsize;
+	int ret, mapped;
+
+	if (!(data = mapfile(path, &size, &mapped))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	ret = doctxt_docx_to_txt(ctx, data, size, DOCTXT_METADATA, &out, &outsize);
+	unmapfile(data, size, mapped);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", path, doctxt_errmsg(ctx));
+		return 0;
+	}
+	fprintf(fp, "%s\t", path);
+	fwrite(out, 1, outsize, fp);
+	return 1;
+}
+
+/* catalog the named files, or the files named on stdin one per line */
+static int
+catalogall(doctxt_ctx *ctx, char **paths, int npaths, FILE *fp)
+{
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	int ok = 1;
+
+	for (int i = 0; i < npaths; i++)
+		ok &= catalog(ctx, paths[i], fp);
+	if (npaths)
+		return ok;
+	while ((len = getline(&line, &linecap, stdin)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len)
+			ok &= catalog(ctx, line, fp);
+	}
+	free(line);
+	return ok;
 }
 
 int
@@ -401,7 +890,13 @@ main(int argc, char *argv[])
 	FILE *outfile = NULL;
 	char *outfilename = "out.txt";
 	char *infilename = NULL;
-	int comments_only = 0;
+	char *data;
+	const char *out;
+	size_t size, outsize;
+	doctxt_ctx *ctx;
+	int flags = 0, ret, meta = 0, ninputs = 0;
+	size_t max_chars = 0, max_paras = 0;
+	char **inputs = ecalloc(argc, sizeof(*inputs));
 
 	if (argc < 2) {
 		usage();
@@ -413,61 +908,92 @@ main(int argc, char *argv[])
 			puts("doctxt-"VERSION);
 			return 0;
 		} else if (!strcmp(argv[i], "-c")) {
-			comments_only = 1;
+			flags |= DOCTXT_COMMENTS;
+		} else if (!strcmp(argv[i], "-a")) {
+			flags |= DOCTXT_ALL_PARTS;
+		} else if (!strcmp(argv[i], "-m")) {
+			meta = 1;
+		} else if (!strcmp(argv[i], "--max-chars")) {
+			if (i + 1 >= argc) {
+				usage();
+			}
+			max_chars = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--max-paragraphs")) {
+			if (i + 1 >= argc) {
+				usage();
+			}
+			max_paras = strtoul(argv[++i], NULL, 10);
 		} else if (!strcmp(argv[i], "-o")) {
 			if (i + 1 >= argc) {
 				usage();
 			}
 			outfilename = argv[i + 1];
 			i++;
-		} else if (argv[i][0] == '-') {
+		} else if (argv[i][0] == '-' && argv[i][1]) {
 			// Unknown flag
 			usage();
 		} else {
 			// Input filename
-			if (infilename != NULL) {
-				usage(); // Multiple input files not allowed
-			}
-			infilename = argv[i];
+			inputs[ninputs++] = argv[i];
 		}
 	}
-
-	// Check if input filename was provided
-	if (infilename == NULL) {
+	// Comments and all parts are different outputs
+	if ((flags & DOCTXT_COMMENTS) && (flags & DOCTXT_ALL_PARTS)) {
 		usage();
 	}
 
-	// Open output file for writing
-	outfile = fopen(outfilename, "wt");
-	if (!outfile) {
-		die("Unable to open output file: %s", outfilename);
+	if (meta) {
+		// Catalog mode takes any number of files
+		if (flags || max_chars || max_paras) {
+			usage();
+		}
+		if (!(ctx = doctxt_new(NULL))) {
+			die("Out of memory");
+		}
+		if (!strcmp(outfilename, "-"))
+			outfile = stdout;
+		else if (!(outfile = fopen(outfilename, "wt")))
+			die("Unable to open output file: %s", outfilename);
+		ret = catalogall(ctx, inputs, ninputs, outfile);
+		if ((outfile == stdout ? fflush(outfile) : fclose(outfile)) != 0) {
+			die("Unable to write output file: %s", outfilename);
+		}
+		doctxt_free(ctx);
+		free(inputs);
+		return !ret;
 	}
 
-	if (comments_only) {
-		// Extract only comments
-		if (readzip(infilename, "word/comments.xml")) {
-			parsecomments(TEMPFILE, outfile);
-			// Remove the temporary file
-			if (remove(TEMPFILE) != 0) {
-				die("Unable to delete tempfile");
-			}
+	// Exactly one input file otherwise
+	if (ninputs != 1) {
+		usage();
+	}
+	infilename = inputs[0];
+
+	if (!(data = readfile(infilename, &size))) {
+		die("Unable to open zip: %s", infilename);
+	}
+	if (!(ctx = doctxt_new(NULL))) {
+		die("Out of memory");
+	}
+	if (max_chars || max_paras) {
+		if (flags) {
+			usage();
 		}
-		// If no comments file, output file will be empty
+		ret = doctxt_docx_preview(ctx, data, size, max_chars, max_paras, &out, &outsize);
 	} else {
-		// Extract document content (text and tables)
-		if (!readzip(infilename, "word/document.xml")) {
-			fclose(outfile);
-			die("File not found in zip: word/document.xml");
-		}
-		parsexml(TEMPFILE, outfile);
-		// Remove the temporary file
-		if (remove(TEMPFILE) != 0) {
-			die("Unable to delete tempfile");
-		}
+		ret = doctxt_docx_to_txt(ctx, data, size, flags, &out, &outsize);
+	}
+	if (ret) {
+		die("%s: %s", infilename, doctxt_errmsg(ctx));
 	}
 
-	// Close the output file
-	fclose(outfile);
+	if (!writefile(outfilename, out, outsize)) {
+		die("Unable to write output file: %s", outfilename);
+	}
+	doctxt_free(ctx);
+	free(data);
+	free(inputs);
 
 	return 0;
 }
+#endif /* DOCTXT_LIB */
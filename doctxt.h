@@ -0,0 +1,123 @@
+/* See LICENSE file for copyright and license details. */
+/*
+ * libdoctxt - docx to text, docx to markdown and markdown to docx.
+ *
+ * Conversions run against a context holding the allocator, the result of
+ * the last conversion and the last error. A context may only be used by one
+ * thread at a time; separate contexts are independent of each other.
+ *
+ * Results are owned by the context and stay valid until the next
+ * conversion on it or doctxt_free(). A failed conversion returns an error
+ * code, sets the result to NULL and leaves the context ready for the next
+ * document.
+ */
+#ifndef DOCTXT_H
+#define DOCTXT_H
+
+#include <stddef.h>
+
+typedef struct doctxt_ctx doctxt_ctx;
+
+typedef struct {
+	void *(*malloc)(void *opaque, size_t size);
+	void *(*realloc)(void *opaque, void *ptr, size_t size);
+	void (*free)(void *opaque, void *ptr);
+	void *opaque;
+} doctxt_allocator;
+
+/* return values */
+enum {
+	DOCTXT_OK = 0,
+	DOCTXT_ENOMEM,          /* out of memory */
+	DOCTXT_EINVAL,          /* invalid argument */
+	DOCTXT_EZIP,            /* input is not a readable zip archive */
+	DOCTXT_ENOPART,         /* a required part is missing */
+	DOCTXT_EXML,            /* malformed XML */
+	DOCTXT_EMARKDOWN,       /* markdown could not be parsed */
+	DOCTXT_EIO              /* reading or writing a file failed */
+};
+
+/* flags for doctxt_docx_to_txt() */
+#define DOCTXT_COMMENTS         (1 << 0)  /* extract comments instead of body */
+#define DOCTXT_ALL_PARTS        (1 << 2)  /* body, headers, footers, notes and
+                                           * comments as labelled sections */
+#define DOCTXT_METADATA         (1 << 3)  /* one catalog record from docProps and
+                                           * the central directory, see README */
+/* flags for doctxt_docx_to_md() */
+#define DOCTXT_SHARED_MEDIA     (1 << 1)  /* name images by content in imgdir */
+
+/* alloc may be NULL for malloc(3) and friends; returns NULL on failure */
+doctxt_ctx *doctxt_new(const doctxt_allocator *alloc);
+void doctxt_free(doctxt_ctx *ctx);
+
+/* docx -> plain text */
+int doctxt_docx_to_txt(doctxt_ctx *ctx, const void *docx, size_t size,
+                       int flags, const char **out, size_t *outsize);
+
+/* docx -> plain text of the body, cut after max_chars characters or
+ * max_paragraphs lines (0: no limit); only as much of the document as the
+ * preview needs is inflated and parsed */
+int doctxt_docx_preview(doctxt_ctx *ctx, const void *docx, size_t size,
+                        size_t max_chars, size_t max_paragraphs,
+                        const char **out, size_t *outsize);
+
+/* docx -> markdown; images are extracted to imgdir, or only referenced
+ * when imgdir is NULL. With DOCTXT_SHARED_MEDIA images are named
+ * <crc32>-<size>.<ext>, <crc32>-<size>-<n>.<ext> when another image has
+ * the same CRC32 and size; files in imgdir with the same bytes are kept
+ * and links include imgdir, so one directory can serve a whole corpus */
+int doctxt_docx_to_md(doctxt_ctx *ctx, const void *docx, size_t size,
+                      const char *imgdir, int flags,
+                      const char **out, size_t *outsize);
+
+/* link the DOCTXT_SHARED_MEDIA images of the following doctxt_docx_to_md()
+ * calls on ctx through dir instead of imgdir, for markdown that is not
+ * read from the current directory; "" links bare names, NULL restores
+ * imgdir */
+int doctxt_set_link_dir(doctxt_ctx *ctx, const char *dir);
+
+/* markdown -> docx; images are read from the paths the markdown names,
+ * unless doctxt_set_image_dir() restricts them */
+int doctxt_md_to_docx(doctxt_ctx *ctx, const char *md, size_t size,
+                      const void **out, size_t *outsize);
+
+/* markdown -> docx file at path, "-" being standard output. With a cache
+ * directory, a document whose markdown, images and options have not
+ * changed since it was last converted is hard linked, or else copied,
+ * from the cache instead of converted again */
+int doctxt_md_to_docx_file(doctxt_ctx *ctx, const char *md, size_t size,
+                           const char *path);
+
+/* use the docx template for the following doctxt_md_to_docx() calls on
+ * ctx: its styles, theme, settings, headers, footers and page setup are
+ * copied into every document, still compressed. The template is copied
+ * and kept until replaced, removed with NULL, or doctxt_free(); it needs
+ * the style ids md2docx uses (Heading1 to Heading6, Code, CodeChar) */
+int doctxt_set_reference_doc(doctxt_ctx *ctx, const void *docx, size_t size);
+
+/* keep the WordprocessingML of the document's sections, cut at headings,
+ * deflated in dir for the following doctxt_md_to_docx() calls on ctx, so
+ * that sections left unchanged since an earlier conversion are neither
+ * converted nor compressed again, and the finished documents for
+ * doctxt_md_to_docx_file(); NULL turns the cache off. dir must exist,
+ * failures to write to it are ignored */
+int doctxt_set_cache_dir(doctxt_ctx *ctx, const char *dir);
+
+/* date every part of the following doctxt_md_to_docx() documents on ctx
+ * mtime, in seconds since the epoch, rather than the time of conversion
+ * and the images' modification times, so that the same markdown, images
+ * and options give the same bytes everywhere; 0 restores the default */
+int doctxt_set_mtime(doctxt_ctx *ctx, long long mtime);
+
+/* read the images of the following doctxt_md_to_docx() documents on ctx
+ * only from files below dir, relative paths being taken relative to it;
+ * images elsewhere are left out of the document. "" leaves out every
+ * image, NULL restores reading any path. Fails with DOCTXT_EIO when dir
+ * does not exist */
+int doctxt_set_image_dir(doctxt_ctx *ctx, const char *dir);
+
+const char *doctxt_strerror(int err);
+/* detailed message for the last failure on ctx */
+const char *doctxt_errmsg(const doctxt_ctx *ctx);
+
+#endif /* DOCTXT_H */
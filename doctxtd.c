@@ -0,0 +1,578 @@
+/*
+ * doctxtd - Conversion daemon for doctxt, docx2md and md2docx
+ *
+ * Listens on a Unix domain socket and runs conversions on a pool of worker
+ * threads, so callers avoid the process start-up cost of the tools.
+ *
+ * Protocol (all integers unsigned, big-endian):
+ *
+ *   request:  u32 magic     "DTXD"
+ *             u8  op        1 = docx -> txt, 2 = docx -> md, 3 = md -> docx
+ *             u8  flags     1 = input is a path, 2 = comments only (op 1),
+ *                           4 = shared media directory (op 2),
+ *                           8 = all text parts (op 1),
+ *                           16 = catalog record (op 1)
+ *             u16 optlen    length of the option string
+ *                           (op 2: directory to extract images to)
+ *             u32 inlen     length of the input bytes or path
+ *             optlen bytes of options, inlen bytes of input
+ *
+ *   response: u32 status    0 on success, see enum status
+ *             chunks of u32 len followed by len bytes, ended by a chunk of
+ *             length 0; on failure the chunks carry an error message
+ *
+ * A connection may carry any number of requests, they are answered in order.
+ *
+ * Whoever can connect to the socket runs conversions as the daemon's user.
+ * The socket is therefore only accessible to that user (or with -g, to its
+ * group), and the default socket lives in a directory private to the user.
+ * Path inputs, image directories and the images markdown names are refused
+ * unless -r names a root directory, and must then resolve to something
+ * below it; refused images are left out of the document.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "doctxt.h"
+#include "util.h"
+
+#define VERSION_STR "0.1"
+#define SOCKET_NAME "doctxtd.sock"
+#define MAGIC 0x44545844u             /* "DTXD" */
+#define MAX_REQUEST (512u * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+#define QUEUE_SIZE 64
+#define IDLE_POLL 250                 /* ms between checks for shutdown */
+
+enum op {
+    OP_DOCX_TO_TXT = 1,
+    OP_DOCX_TO_MD = 2,
+    OP_MD_TO_DOCX = 3
+};
+
+enum {
+    FLAG_PATH = 1 << 0,
+    FLAG_COMMENTS = 1 << 1,
+    FLAG_SHARED_MEDIA = 1 << 2,
+    FLAG_ALL_PARTS = 1 << 3,
+    FLAG_METADATA = 1 << 4
+};
+
+enum status {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1,
+    STATUS_INPUT = 2,
+    STATUS_CONVERT = 3
+};
+
+/* Growable byte buffer, kept by each worker across requests */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} buffer;
+
+/* Bounded queue of accepted connections; closed when the daemon stops */
+static struct {
+    int fds[QUEUE_SIZE];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+static volatile sig_atomic_t stop;
+static char *root;                    /* realpath of -r, or NULL */
+
+static void queue_push(int fd)
+{
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_SIZE)
+        pthread_cond_wait(&queue.not_full, &queue.lock);
+    queue.fds[(queue.head + queue.count) % QUEUE_SIZE] = fd;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Next connection, or -1 once the queue is closed and empty */
+static int queue_pop(void)
+{
+    int fd;
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0 && !queue.closed)
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+    if (queue.count == 0) {
+        pthread_mutex_unlock(&queue.lock);
+        return -1;
+    }
+    fd = queue.fds[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_SIZE;
+    queue.count--;
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+    return fd;
+}
+
+static void queue_close(void)
+{
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Make room for size bytes plus a terminating NUL */
+static int buffer_reserve(buffer *buf, size_t size)
+{
+    if (size + 1 <= buf->capacity)
+        return 1;
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < size + 1)
+        capacity *= 2;
+    char *data = realloc(buf->data, capacity);
+    if (!data)
+        return 0;
+    buf->data = data;
+    buf->capacity = capacity;
+    return 1;
+}
+
+static int read_full(int fd, void *data, size_t size)
+{
+    char *p = data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int write_u32(int fd, uint32_t v)
+{
+    v = htonl(v);
+    return write_full(fd, &v, sizeof(v));
+}
+
+/* Send a complete response: status, payload in chunks, terminator */
+static int respond(int fd, enum status status, const char *data, size_t size)
+{
+    if (!write_u32(fd, status))
+        return 0;
+    while (size > 0) {
+        size_t n = MIN(size, CHUNK_SIZE);
+        if (!write_u32(fd, n) || !write_full(fd, data, n))
+            return 0;
+        data += n;
+        size -= n;
+    }
+    return write_u32(fd, 0);
+}
+
+static int respond_error(int fd, enum status status, const char *msg)
+{
+    return respond(fd, status, msg, strlen(msg));
+}
+
+/* Resolve a path from a request, relative to the root, into real; fails
+ * when the path leads outside the root */
+static int resolve_path(const char *path, char *real)
+{
+    char joined[PATH_MAX];
+    size_t len;
+
+    if (snprintf(joined, sizeof(joined), "%s/%s", root, path) >= (int)sizeof(joined)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    if (!realpath(path[0] == '/' ? path : joined, real))
+        return 0;
+    len = strlen(root);
+    if (strncmp(real, root, len) != 0 ||
+        (len > 1 && real[len] != '/' && real[len] != '\0')) {
+        errno = EACCES;
+        return 0;
+    }
+    return 1;
+}
+
+/* Read a file named by a request into buf */
+static int load_path(buffer *buf, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    buf->size = 0;
+    for (;;) {
+        if (!buffer_reserve(buf, buf->size + CHUNK_SIZE)) {
+            close(fd);
+            return 0;
+        }
+        ssize_t n = read(fd, buf->data + buf->size, CHUNK_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            close(fd);
+            return 0;
+        }
+        if (n == 0)
+            break;
+        buf->size += n;
+    }
+    close(fd);
+    buf->data[buf->size] = '\0';
+    return 1;
+}
+
+/* Run one conversion; the result lives in the worker's context */
+static int convert(doctxt_ctx *ctx, int op, int flags, const char *opt,
+                   buffer *in, const char **out, size_t *out_size)
+{
+    switch (op) {
+    case OP_DOCX_TO_TXT:
+        return doctxt_docx_to_txt(ctx, in->data, in->size,
+                                  (flags & FLAG_COMMENTS ? DOCTXT_COMMENTS : 0) |
+                                  (flags & FLAG_ALL_PARTS ? DOCTXT_ALL_PARTS : 0) |
+                                  (flags & FLAG_METADATA ? DOCTXT_METADATA : 0),
+                                  out, out_size);
+    case OP_DOCX_TO_MD:
+        return doctxt_docx_to_md(ctx, in->data, in->size, opt[0] ? opt : NULL,
+                                 flags & FLAG_SHARED_MEDIA ? DOCTXT_SHARED_MEDIA : 0,
+                                 out, out_size);
+    default:
+        return doctxt_md_to_docx(ctx, in->data, in->size,
+                                 (const void **)out, out_size);
+    }
+}
+
+/* Wait for the next request on a connection; once the daemon stops, only
+ * a request that has already arrived is served */
+static int wait_request(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    for (;;) {
+        int n = poll(&pfd, 1, stop ? 0 : IDLE_POLL);
+        if (n > 0)
+            return 1;
+        if ((n < 0 && errno != EINTR) || stop)
+            return 0;
+    }
+}
+
+/* Answer one request; returns 0 when the connection should be dropped */
+static int serve_request(int fd, doctxt_ctx *ctx, buffer *in, buffer *opt)
+{
+    unsigned char hdr[12];
+    uint32_t magic, inlen;
+    unsigned op, flags, optlen;
+    const char *out;
+    size_t out_size;
+
+    if (!wait_request(fd) || !read_full(fd, hdr, sizeof(hdr)))
+        return 0;
+    magic = (uint32_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+    op = hdr[4];
+    flags = hdr[5];
+    optlen = hdr[6] << 8 | hdr[7];
+    inlen = (uint32_t)hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11];
+
+    if (magic != MAGIC || op < OP_DOCX_TO_TXT || op > OP_MD_TO_DOCX ||
+        inlen > MAX_REQUEST) {
+        respond_error(fd, STATUS_BAD_REQUEST, "bad request header");
+        return 0;
+    }
+    if (!buffer_reserve(opt, optlen) || !buffer_reserve(in, inlen)) {
+        respond_error(fd, STATUS_BAD_REQUEST, "out of memory");
+        return 0;
+    }
+    if (!read_full(fd, opt->data, optlen) || !read_full(fd, in->data, inlen))
+        return 0;
+    opt->data[optlen] = '\0';
+    in->data[inlen] = '\0';
+    in->size = inlen;
+
+    if (!root && ((flags & FLAG_PATH) || (op == OP_DOCX_TO_MD && optlen)))
+        return respond_error(fd, STATUS_INPUT, "paths are refused, doctxtd runs without -r");
+    if (flags & FLAG_PATH) {
+        char real[PATH_MAX];
+        if (inlen >= sizeof(real))
+            return respond_error(fd, STATUS_BAD_REQUEST, "path too long");
+        if (!resolve_path(in->data, real) || !load_path(in, real))
+            return respond_error(fd, STATUS_INPUT, strerror(errno));
+    }
+
+    /* The image directory is a path too */
+    if (op == OP_DOCX_TO_MD && optlen) {
+        char dir[PATH_MAX];
+        if (!resolve_path(opt->data, dir))
+            return respond_error(fd, STATUS_INPUT, strerror(errno));
+        if (!buffer_reserve(opt, strlen(dir)))
+            return respond_error(fd, STATUS_BAD_REQUEST, "out of memory");
+        strcpy(opt->data, dir);
+    }
+
+    if (convert(ctx, op, flags, opt->data, in, &out, &out_size) != DOCTXT_OK)
+        return respond_error(fd, STATUS_CONVERT, doctxt_errmsg(ctx));
+    return respond(fd, STATUS_OK, out, out_size);
+}
+
+static void *worker(void *arg)
+{
+    /* Buffers and the conversion context stay warm across connections
+     * and requests */
+    buffer in = {0}, opt = {0};
+    doctxt_ctx *ctx = doctxt_new(NULL);
+    int fd;
+
+    (void)arg;
+    if (!ctx)
+        die("Out of memory");
+    /* Markdown names image files too: below the root, or none at all */
+    if (doctxt_set_image_dir(ctx, root ? root : "") != DOCTXT_OK)
+        die("%s", doctxt_errmsg(ctx));
+    while ((fd = queue_pop()) >= 0) {
+        while (serve_request(fd, ctx, &in, &opt))
+            ;
+        close(fd);
+    }
+    doctxt_free(ctx);
+    free(in.data);
+    free(opt.data);
+    return NULL;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/* Accept a connection on the non-blocking listening socket; -1 when none
+ * is waiting. The connection itself blocks, whatever it inherits */
+static int accept_connection(int sock)
+{
+    int fd;
+
+    for (;;) {
+        fd = accept(sock, NULL, NULL);
+        if (fd >= 0)
+            break;
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            die("accept:");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+/* Default socket: in $XDG_RUNTIME_DIR, or in a directory of our own in
+ * /tmp that nobody else can enter */
+static void default_socket(char *path, size_t size)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char dir[64];
+    struct stat st;
+
+    if (runtime && runtime[0] == '/') {
+        if (snprintf(path, size, "%s/%s", runtime, SOCKET_NAME) >= (int)size)
+            die("Socket path too long: %s/%s", runtime, SOCKET_NAME);
+        return;
+    }
+    snprintf(dir, sizeof(dir), "/tmp/doctxtd-%lu", (unsigned long)getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        die("mkdir %s:", dir);
+    if (lstat(dir, &st) < 0)
+        die("%s:", dir);
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+        die("%s is not a private directory of this user", dir);
+    snprintf(path, size, "%s/%s", dir, SOCKET_NAME);
+}
+
+/* Remove a socket left behind by a daemon that is gone; anything else at
+ * path, or a socket that still has a listener, is left alone */
+static void remove_stale_socket(const struct sockaddr_un *addr)
+{
+    struct stat st;
+    int fd;
+
+    if (lstat(addr->sun_path, &st) < 0) {
+        if (errno == ENOENT)
+            return;
+        die("%s:", addr->sun_path);
+    }
+    if (!S_ISSOCK(st.st_mode))
+        die("%s exists and is not a socket", addr->sun_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die("socket:");
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+        die("%s: another daemon is listening", addr->sun_path);
+    if (errno != ECONNREFUSED)
+        die("connect %s:", addr->sun_path);
+    close(fd);
+    unlink(addr->sun_path);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: doctxtd [-s socket] [-g] [-r root] [-j threads]\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -s PATH    Socket to listen on (default: $XDG_RUNTIME_DIR/%s,\n", SOCKET_NAME);
+    fprintf(stderr, "             or /tmp/doctxtd-UID/%s)\n", SOCKET_NAME);
+    fprintf(stderr, "  -g         Let the socket's group connect, not only this user\n");
+    fprintf(stderr, "  -r DIR     Allow path inputs and images below DIR\n");
+    fprintf(stderr, "  -j N       Number of worker threads (default: online CPUs)\n");
+    fprintf(stderr, "  -v         Display version information\n");
+    fprintf(stderr, "  -h         Display this help message\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_path = NULL;
+    char default_path[sizeof(((struct sockaddr_un *)0)->sun_path) + 64];
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    int group = 0;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    sigset_t signals, waiting;
+    fd_set readable;
+    mode_t mask;
+    int sock, fd;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            printf("doctxtd version %s\n", VERSION_STR);
+            return 0;
+        } else if (strcmp(argv[i], "-h") == 0) {
+            usage();
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0) {
+            group = 1;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            if (!(root = realpath(argv[++i], NULL)))
+                die("%s:", argv[i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = strtol(argv[++i], NULL, 10);
+        } else {
+            usage();
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (!socket_path) {
+        default_socket(default_path, sizeof(default_path));
+        socket_path = default_path;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        die("Socket path too long: %s", socket_path);
+    strcpy(addr.sun_path, socket_path);
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;   /* no SA_RESTART: accept() must return */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die("socket:");
+    remove_stale_socket(&addr);
+    mask = umask(group ? 0117 : 0177);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind %s:", socket_path);
+    umask(mask);
+    if (listen(sock, SOMAXCONN) < 0)
+        die("listen:");
+
+    /* Signals stay blocked but while the accept loop waits, so none is
+     * lost between checking stop and waiting; the workers never see them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &waiting);
+    if (!(threads = calloc(nthreads, sizeof(*threads))))
+        die("Out of memory");
+    for (long i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            die("pthread_create:");
+    }
+
+    /* Non-blocking, as a connection may be gone again by the time it is
+     * accepted */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    while (!stop) {
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        if (pselect(sock + 1, &readable, NULL, NULL, NULL, &waiting) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("pselect:");
+        }
+        if ((fd = accept_connection(sock)) >= 0)
+            queue_push(fd);
+    }
+
+    /* Take what is waiting in the backlog, stop accepting, then let the
+     * workers finish the queued connections and the requests in flight */
+    while ((fd = accept_connection(sock)) >= 0)
+        queue_push(fd);
+    close(sock);
+    unlink(socket_path);
+    queue_close();
+    for (long i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(root);
+    return 0;
+}
@@ -8,63 +8,145 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "miniz.h"
+#include "doctxt.h"
 #include "util.h"
-
-#define TXML_DEFINE
 #include "txml.h"
 
 #define VERSION_STR "0.1"
 #define MAX_BUFFER_SIZE (10 * 1024 * 1024)
+#define IMAGE_THREADS 4
+#define IMAGE_QUEUE 64
+#define CHUNK_MIN 1024          /* Body children per conversion thread */
+#define MAX_CHUNKS 32
 
-/* Generate temporary file path - Note: caller should remove the file when done */
-static char *get_temp_file_path(void) {
-    static char temp_path[256];
-    snprintf(temp_path, sizeof(temp_path), "/tmp/docx2md-temp-%d.xml", getpid());
-    return temp_path;
-}
+/* Open-addressing table of entries whose first member is their string
+ * ID; a NULL ID marks a free slot */
+typedef struct {
+    void *slots;
+    size_t entry_size;
+    size_t mask;                /* Slot count - 1, a power of two - 1 */
+    size_t count;
+} id_table;
+
+/* Relationship from document.xml.rels */
+typedef struct {
+    const char *id;     /* Relationship ID (e.g., "rId3") */
+    const char *type;   /* Last segment of the type URI (e.g., "image", "hyperlink") */
+    const char *target; /* Target path (e.g., "media/image1.png") or URL */
+    int external;       /* TargetMode="External" */
+} relationship;
+
+/* What a paragraph style means for markdown */
+enum style_kind {
+    STYLE_NONE,
+    STYLE_HEADING,
+    STYLE_CODE,
+    STYLE_QUOTE
+};
+
+/* Paragraph style from styles.xml */
+typedef struct {
+    const char *id;     /* w:styleId, possibly localized (e.g., "berschrift1") */
+    const char *based_on;
+    unsigned char kind; /* enum style_kind, after basedOn is resolved */
+    unsigned char level; /* Heading level 1-6 */
+    unsigned char own;  /* Kind comes from the style itself, not inherited */
+    unsigned char state; /* 0 unresolved, 1 resolving, 2 resolved */
+    const char *num_id; /* w:numPr list, after basedOn is resolved, or NULL */
+    unsigned char ilvl; /* List level 0-8 */
+} style;
+
+/* List definition from numbering.xml, by w:numId (or w:abstractNumId
+ * while parsing) */
+typedef struct {
+    const char *id;
+    unsigned ordered;   /* Bit per level: numbered rather than bulleted */
+} numbering;
 
-/* Structure to hold image relationship information */
+/* Image waiting to be written */
 typedef struct {
-    char *rel_id;       /* Relationship ID (e.g., "rId3") */
-    char *target;       /* Target path (e.g., "media/image1.png") */
-} image_rel;
+    mz_uint index;              /* Entry in the archive */
+    const char *path;           /* Output file, arena allocated */
+} image_job;
+
+/* Bounded queue feeding the image writer threads; shared by all chunks
+ * of a document, everything below docx is guarded by lock */
+typedef struct {
+    const void *docx;           /* Archive bytes, shared read-only */
+    size_t size;
+    unsigned char *written;     /* Per archive entry: already queued */
+    int started;
+    int inline_only;            /* Threads unavailable, write inline */
+    image_job jobs[IMAGE_QUEUE];
+    int head;
+    int count;
+    int done;                   /* No more jobs will be queued */
+    const char *failed;         /* First path that could not be written */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t threads[IMAGE_THREADS];
+    int nthreads;
+} image_pool;
+
+/* Run formatting, decoded from w:rPr */
+enum {
+    FMT_BOLD = 1 << 0,
+    FMT_ITALIC = 1 << 1,
+    FMT_STRIKE = 1 << 2,
+    FMT_UNDERLINE = 1 << 3,     /* Decoded, but markdown has no underline */
+    FMT_CODE = 1 << 4
+};
 
 /* Context structure to hold state during conversion */
 typedef struct {
-    FILE *output;
-    int in_bold;
-    int in_italic;
-    int in_code;
-    int in_strikethrough;
-    int in_underline;
+    doctxt_ctx *dt;             /* Library context: allocator, output, errors */
     int in_table;
     int table_col_count;
     int first_table_row;
     mz_zip_archive *zip;        /* ZIP archive for extracting images */
-    image_rel *image_rels;      /* Array of image relationships */
-    int image_rel_count;        /* Number of image relationships */
+    id_table rels;              /* relationship by ID */
+    id_table styles;            /* style by ID */
+    id_table lists;             /* numbering by w:numId */
     const char *output_dir;     /* Directory for output file (for extracting images) */
+    image_pool *pool;           /* Image writers, started on the first image */
+    int shared_media;           /* DOCTXT_SHARED_MEDIA */
+    const char *link_dir;       /* Shared media links go through it, or NULL */
 } md_context;
 
+/* Contiguous range of body children converted on its own thread, into
+ * its own library context */
+typedef struct {
+    md_context ctx;
+    doctxt_ctx *dt;
+    mz_zip_archive zip;
+    struct txml_node **children;
+    size_t count;
+    pthread_t thread;
+    int running;
+} body_chunk;
+
 /* Forward declarations */
 static void process_paragraph(struct txml_node *para, md_context *ctx);
 static void process_run(struct txml_node *run, md_context *ctx);
 static void process_table(struct txml_node *table, md_context *ctx);
 static void process_drawing(struct txml_node *drawing, md_context *ctx);
-static void parse_relationships(const char *docx_path, md_context *ctx);
-static void free_image_rels(md_context *ctx);
-static char *xml_unescape(const char *in);
+static void parse_relationships(md_context *ctx);
+static char *xml_unescape(md_context *ctx, const char *in);
 
 /* XML unescape helper */
-static char *xml_unescape(const char *in) {
+static char *xml_unescape(md_context *ctx, const char *in) {
     if (!in) return NULL;
     
-    char *out = malloc(strlen(in) + 1);  // Output will never be longer than input
+    char *out = arena_alloc(ctx->dt, strlen(in) + 1);  // Output will never be longer than input
     if (!out) {
-        die("Out of memory in xml_unescape");
+        return NULL;
     }
     
     char *dst = out;
@@ -94,7 +176,7 @@ static char *xml_unescape(const char *in) {
     return out;
 }
 
-/* Get paragraph style to determine heading level or code block */
+/* Get the paragraph's style ID */
 static const char *get_paragraph_style(struct txml_node *para) {
     struct txml_node *pPr = txml_find(para, NULL, TXML_ELEMENT, "w:pPr", NULL, 0);
     if (!pPr) return NULL;
@@ -120,140 +202,528 @@ static int has_horizontal_rule(struct txml_node *para) {
     return bottom != NULL;
 }
 
-/* Parse relationships from document.xml.rels to get image mappings */
-static void parse_relationships(const char *docx_path, md_context *ctx) {
-    mz_zip_archive *zip = ctx->zip;
+/* FNV-1a, for the ID tables */
+static unsigned long hash_string(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619UL;
+    }
+    return h;
+}
+
+/* Slot holding id, or the free slot where it belongs */
+static void *id_table_slot(const id_table *t, const char *id) {
+    size_t i = hash_string(id) & t->mask;
+    for (;;) {
+        char *slot = (char *)t->slots + i * t->entry_size;
+        const char *key = *(const char **)slot;
+        if (!key || strcmp(key, id) == 0) return slot;
+        i = (i + 1) & t->mask;
+    }
+}
+
+/* Find the entry for id */
+static void *id_table_find(const id_table *t, const char *id) {
+    if (!t->slots) return NULL;
+    void *slot = id_table_slot(t, id);
+    return *(const char **)slot ? slot : NULL;
+}
+
+/* Copy entry into the table, doubling it at half load; the first entry
+ * with a given ID wins */
+static void id_table_add(md_context *ctx, id_table *t, const void *entry) {
+    if (!t->slots || t->count * 2 >= t->mask + 1) {
+        id_table grown = *t;
+        grown.mask = t->slots ? t->mask * 2 + 1 : 63;
+        grown.slots = arena_alloc(ctx->dt, (grown.mask + 1) * t->entry_size);
+        if (!grown.slots) return;
+        memset(grown.slots, 0, (grown.mask + 1) * t->entry_size);
+        for (size_t i = 0; t->slots && i <= t->mask; i++) {
+            char *old = (char *)t->slots + i * t->entry_size;
+            if (*(const char **)old) {
+                memcpy(id_table_slot(&grown, *(const char **)old), old, t->entry_size);
+            }
+        }
+        *t = grown;
+    }
     
-    /* Extract document.xml.rels */
-    int file_index = mz_zip_reader_locate_file(zip, "word/_rels/document.xml.rels", NULL, 0);
-    if (file_index < 0) {
-        /* No relationships file - no images */
+    void *slot = id_table_slot(t, *(const char *const *)entry);
+    if (!*(const char **)slot) {
+        memcpy(slot, entry, t->entry_size);
+        t->count++;
+    }
+}
+
+/* Parse document.xml.rels into the relationship table */
+static void parse_relationships(md_context *ctx) {
+    /* No relationships part means no images or links */
+    size_t xml_size;
+    char *xml = dt_zip_part(ctx->dt, ctx->zip, "word/_rels/document.xml.rels", &xml_size);
+    if (!xml) {
         return;
     }
     
-    size_t file_size;
-    void *file_data = mz_zip_reader_extract_to_heap(zip, file_index, &file_size, 0);
-    if (!file_data) {
+    struct txml_node *nodes = dt_parse_xml(ctx->dt, xml, xml_size);
+    if (!nodes) {
         return;
     }
     
-    /* Write to temporary file for txml_parse_file 
-     * Note: Using predictable temp path based on PID. For high-security environments,
-     * consider using mkstemp() for secure temp file creation. Current approach is
-     * acceptable for read-only XML parsing in typical use cases.
-     */
-    char temp_path[256];
-    snprintf(temp_path, sizeof(temp_path), "/tmp/docx2md-rels-%d.xml", getpid());
-    FILE *temp = fopen(temp_path, "wb");
-    if (!temp) {
-        mz_free(file_data);
-        return;
+    /* Relationship elements are empty, so their attributes follow them
+     * directly in the node array and one pass over it sees everything;
+     * nodes[0] is txml's root sentinel */
+    for (struct txml_node *node = nodes + 1; node->type != TXML_EOF && !ctx->dt->err; node++) {
+        if (node->type != TXML_ELEMENT || strcmp(node->name, "Relationship") != 0) {
+            continue;
+        }
+        
+        const char *id = NULL, *type = NULL, *target = NULL, *mode = NULL;
+        struct txml_node *attr;
+        for (attr = node + 1; attr->type == TXML_ATTRIBUTE && attr->parent == node; attr++) {
+            if (strcmp(attr->name, "Id") == 0) id = attr->value;
+            else if (strcmp(attr->name, "Type") == 0) type = attr->value;
+            else if (strcmp(attr->name, "Target") == 0) target = attr->value;
+            else if (strcmp(attr->name, "TargetMode") == 0) mode = attr->value;
+        }
+        node = attr - 1;
+        if (!id || !type || !target) {
+            continue;
+        }
+        
+        /* Keep only the last segment of the type URI, e.g. "image" */
+        const char *slash = strrchr(type, '/');
+        relationship rel;
+        rel.id = arena_strdup(ctx->dt, id);
+        rel.type = arena_strdup(ctx->dt, slash ? slash + 1 : type);
+        rel.target = arena_strdup(ctx->dt, target);
+        rel.external = mode && strcmp(mode, "External") == 0;
+        if (rel.id && rel.type && rel.target) {
+            id_table_add(ctx, &ctx->rels, &rel);
+        }
+    }
+}
+
+/* Find image target by relationship ID */
+static const char *find_image_target(md_context *ctx, const char *rel_id) {
+    const relationship *rel = id_table_find(&ctx->rels, rel_id);
+    if (!rel || rel->external || strcmp(rel->type, "image") != 0) {
+        return NULL;
     }
-    fwrite(file_data, 1, file_size, temp);
-    fclose(temp);
-    mz_free(file_data);
+    return rel->target;
+}
+
+/* Classify a style by its name or ID, e.g. "heading 2", "Heading2",
+ * "Quote", "List Paragraph"; returns STYLE_NONE when it says nothing */
+static int classify_style_name(const char *name, unsigned char *level) {
+    char key[32];
+    size_t n = 0;
+    
+    /* Compare lowercase without spaces */
+    for (; *name && n < sizeof(key) - 1; name++) {
+        if (*name != ' ') key[n++] = tolower((unsigned char)*name);
+    }
+    key[n] = '\0';
     
-    /* Parse the relationships XML using txml_parse_file */
-    struct txml_node *nodes = NULL;
-    char *xml_data = txml_parse_file(temp_path, &nodes);
-    if (!xml_data) {
-        if (nodes) free(nodes);
-        remove(temp_path);
+    if (strncmp(key, "heading", 7) == 0 && key[7] >= '1' && key[7] <= '9' && !key[8]) {
+        *level = MIN(key[7] - '0', 6);
+        return STYLE_HEADING;
+    }
+    if (strcmp(key, "code") == 0 || strcmp(key, "sourcecode") == 0 ||
+        strcmp(key, "htmlpreformatted") == 0) {
+        return STYLE_CODE;
+    }
+    if (strcmp(key, "quote") == 0 || strcmp(key, "intensequote") == 0 ||
+        strcmp(key, "blocktext") == 0) {
+        return STYLE_QUOTE;
+    }
+    return STYLE_NONE;
+}
+
+/* Value of the w:val attribute of child element name, or NULL */
+static const char *child_val(struct txml_node *parent, const char *name) {
+    struct txml_node *child = txml_find(parent, NULL, TXML_ELEMENT, name, NULL, 0);
+    if (!child) return NULL;
+    struct txml_node *val = txml_find(child, NULL, TXML_ATTRIBUTE, "w:val", NULL, 0);
+    return val ? val->value : NULL;
+}
+
+/* List level of a w:ilvl value, 0-8 */
+static int list_level(const char *ilvl) {
+    int lvl = ilvl ? atoi(ilvl) : 0;
+    return lvl < 0 ? 0 : MIN(lvl, 8);
+}
+
+/* Inherit the kind and list through basedOn; a basedOn cycle ends the
+ * chain */
+static void resolve_style(md_context *ctx, style *st) {
+    if (st->state) return;
+    st->state = 1;
+    style *base = st->based_on ? id_table_find(&ctx->styles, st->based_on) : NULL;
+    if (base) {
+        resolve_style(ctx, base);
+        if (!st->own) {
+            st->kind = base->kind;
+            st->level = base->level;
+        }
+        if (!st->num_id) {
+            st->num_id = base->num_id;
+            st->ilvl = base->ilvl;
+        }
+    }
+    st->state = 2;
+}
+
+/* Build the style table from styles.xml. A style is classified by its own
+ * w:outlineLvl, then its name (built-in names stay English when IDs are
+ * localized), then its ID, and otherwise inherits from basedOn. */
+static void parse_styles(md_context *ctx) {
+    size_t xml_size;
+    char *xml = dt_zip_part(ctx->dt, ctx->zip, "word/styles.xml", &xml_size);
+    if (!xml) {
         return;
     }
-    if (!nodes) {
-        free(xml_data);
-        remove(temp_path);
+    
+    struct txml_node *nodes = dt_parse_xml(ctx->dt, xml, xml_size);
+    struct txml_node *root = nodes ? txml_find(nodes, NULL, TXML_ELEMENT, "w:styles", NULL, 0) : NULL;
+    if (!root) {
         return;
     }
     
-    /* Count image relationships first - use recursive search from root */
-    ctx->image_rel_count = 0;
-    struct txml_node *rel = NULL;
-    while ((rel = txml_find(nodes, rel, TXML_ELEMENT, "Relationship", NULL, 1))) {
-        struct txml_node *type_attr = txml_find(rel, NULL, TXML_ATTRIBUTE, "Type", NULL, 0);
-        if (type_attr && type_attr->value && 
-            strstr(type_attr->value, "/image") != NULL) {
-            ctx->image_rel_count++;
+    struct txml_node *node = NULL;
+    while ((node = txml_find(root, node, TXML_ELEMENT, "w:style", NULL, 0)) && !ctx->dt->err) {
+        struct txml_node *type = txml_find(node, NULL, TXML_ATTRIBUTE, "w:type", NULL, 0);
+        struct txml_node *id = txml_find(node, NULL, TXML_ATTRIBUTE, "w:styleId", NULL, 0);
+        if (!type || !type->value || strcmp(type->value, "paragraph") != 0 || !id || !id->value) {
+            continue;
+        }
+        
+        style st = {0};
+        st.id = id->value;
+        st.based_on = child_val(node, "w:basedOn");
+        
+        struct txml_node *pPr = txml_find(node, NULL, TXML_ELEMENT, "w:pPr", NULL, 0);
+        struct txml_node *numPr = pPr ? txml_find(pPr, NULL, TXML_ELEMENT, "w:numPr", NULL, 0) : NULL;
+        if (numPr) {
+            st.num_id = child_val(numPr, "w:numId");
+            st.ilvl = list_level(child_val(numPr, "w:ilvl"));
         }
+        const char *outline = pPr ? child_val(pPr, "w:outlineLvl") : NULL;
+        const char *name = child_val(node, "w:name");
+        if (outline && isdigit((unsigned char)outline[0])) {
+            /* Levels 0-8 are headings, 9 is body text */
+            int lvl = atoi(outline);
+            st.kind = lvl < 9 ? STYLE_HEADING : STYLE_NONE;
+            st.level = MIN(lvl + 1, 6);
+            st.own = 1;
+        } else if ((name && (st.kind = classify_style_name(name, &st.level))) ||
+                   (st.kind = classify_style_name(st.id, &st.level))) {
+            st.own = 1;
+        }
+        id_table_add(ctx, &ctx->styles, &st);
     }
     
-    if (ctx->image_rel_count == 0) {
-        free(nodes);
-        free(xml_data);
-        remove(temp_path);
+    for (size_t i = 0; ctx->styles.slots && i <= ctx->styles.mask; i++) {
+        style *st = (style *)ctx->styles.slots + i;
+        if (st->id) resolve_style(ctx, st);
+    }
+}
+
+/* Levels of the w:lvl elements below node that are numbered rather than
+ * bulleted, one bit per level; levels with a w:numFmt are set in *defined */
+static unsigned list_formats(struct txml_node *node, unsigned *defined) {
+    unsigned ordered = 0;
+    struct txml_node *lvl = NULL;
+    *defined = 0;
+    while ((lvl = txml_find(node, lvl, TXML_ELEMENT, "w:lvl", NULL, 1))) {
+        struct txml_node *ilvl = txml_find(lvl, NULL, TXML_ATTRIBUTE, "w:ilvl", NULL, 0);
+        const char *fmt = child_val(lvl, "w:numFmt");
+        if (!fmt) continue;
+        
+        unsigned bit = 1u << list_level(ilvl ? ilvl->value : NULL);
+        *defined |= bit;
+        if (strcmp(fmt, "bullet") != 0 && strcmp(fmt, "none") != 0) {
+            ordered |= bit;
+        }
+    }
+    return ordered;
+}
+
+/* Build the list table from numbering.xml: each w:num takes the level
+ * formats of its w:abstractNum, then of its own w:lvlOverride elements */
+static void parse_numbering(md_context *ctx) {
+    size_t xml_size;
+    char *xml = dt_zip_part(ctx->dt, ctx->zip, "word/numbering.xml", &xml_size);
+    if (!xml) {
         return;
     }
     
-    /* Allocate array for relationships */
-    ctx->image_rels = calloc(ctx->image_rel_count, sizeof(image_rel));
-    if (!ctx->image_rels) {
-        free(nodes);
-        free(xml_data);
-        remove(temp_path);
+    struct txml_node *nodes = dt_parse_xml(ctx->dt, xml, xml_size);
+    struct txml_node *root = nodes ? txml_find(nodes, NULL, TXML_ELEMENT, "w:numbering", NULL, 0) : NULL;
+    if (!root) {
         return;
     }
     
-    /* Fill in the relationship data */
-    int idx = 0;
-    rel = NULL;
-    while ((rel = txml_find(nodes, rel, TXML_ELEMENT, "Relationship", NULL, 1)) && idx < ctx->image_rel_count) {
-        struct txml_node *type_attr = txml_find(rel, NULL, TXML_ATTRIBUTE, "Type", NULL, 0);
-        if (type_attr && type_attr->value && 
-            strstr(type_attr->value, "/image") != NULL) {
-            
-            struct txml_node *id_attr = txml_find(rel, NULL, TXML_ATTRIBUTE, "Id", NULL, 0);
-            struct txml_node *target_attr = txml_find(rel, NULL, TXML_ATTRIBUTE, "Target", NULL, 0);
-            
-            if (id_attr && id_attr->value && target_attr && target_attr->value) {
-                char *rel_id = strdup(id_attr->value);
-                char *target = strdup(target_attr->value);
-                
-                if (rel_id && target) {
-                    ctx->image_rels[idx].rel_id = rel_id;
-                    ctx->image_rels[idx].target = target;
-                    idx++;
-                } else {
-                    /* Handle allocation failure */
-                    free(rel_id);
-                    free(target);
-                }
+    id_table abstracts = {0};
+    abstracts.entry_size = sizeof(numbering);
+    struct txml_node *node = NULL;
+    unsigned defined;
+    while ((node = txml_find(root, node, TXML_ELEMENT, "w:abstractNum", NULL, 0)) && !ctx->dt->err) {
+        struct txml_node *id = txml_find(node, NULL, TXML_ATTRIBUTE, "w:abstractNumId", NULL, 0);
+        if (!id || !id->value) continue;
+        
+        numbering abs = {id->value, list_formats(node, &defined)};
+        id_table_add(ctx, &abstracts, &abs);
+    }
+    
+    node = NULL;
+    while ((node = txml_find(root, node, TXML_ELEMENT, "w:num", NULL, 0)) && !ctx->dt->err) {
+        struct txml_node *id = txml_find(node, NULL, TXML_ATTRIBUTE, "w:numId", NULL, 0);
+        const char *abstract_id = child_val(node, "w:abstractNumId");
+        if (!id || !id->value || !abstract_id) continue;
+        
+        const numbering *abs = id_table_find(&abstracts, abstract_id);
+        unsigned ordered = list_formats(node, &defined);
+        numbering num = {id->value, ((abs ? abs->ordered : 0) & ~defined) | ordered};
+        id_table_add(ctx, &ctx->lists, &num);
+    }
+}
+
+/* What a paragraph's style means; documents without styles.xml still get
+ * their style IDs recognized */
+static int classify_paragraph(md_context *ctx, const char *style_id, unsigned char *level) {
+    if (!style_id) return STYLE_NONE;
+    
+    const style *st = id_table_find(&ctx->styles, style_id);
+    if (st) {
+        *level = st->level;
+        return st->kind;
+    }
+    return classify_style_name(style_id, level);
+}
+
+/* Inflate archive entry index straight into a file at path */
+static int write_image(mz_zip_archive *zip, const image_job *job) {
+    FILE *img_file = fopen(job->path, "wb");
+    if (!img_file) {
+        return 0;
+    }
+    
+    int ok = mz_zip_reader_extract_to_cfile(zip, job->index, img_file, 0);
+    if (fclose(img_file) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        remove(job->path);
+    }
+    return ok;
+}
+
+/* Shared media file being compared with an archive entry as it inflates */
+typedef struct {
+    const char *data;
+    size_t size;
+} image_compare;
+
+static size_t compare_image_chunk(void *opaque, mz_uint64 ofs, const void *buf, size_t n) {
+    image_compare *c = opaque;
+    if (ofs + n > c->size || memcmp(c->data + ofs, buf, n) != 0) {
+        return 0;   /* stops the inflate */
+    }
+    return n;
+}
+
+/* Whether the file at path holds exactly archive entry index */
+static int same_image(mz_zip_archive *zip, mz_uint index, mz_uint64 size, const char *path) {
+    image_compare c;
+    int mapped;
+    if (!(c.data = mapfile(path, &c.size, &mapped))) {
+        return 0;
+    }
+    int same = c.size == size &&
+               mz_zip_reader_extract_to_callback(zip, index, compare_image_chunk, &c, 0);
+    unmapfile(c.data, c.size, mapped);
+    return same;
+}
+
+/* Store archive entry index as the shared media file path, unless a file
+ * of that name appeared in the meantime. It is written under a temporary
+ * name and linked into place, so concurrent runs never see a partial
+ * file and never replace each other's. Returns 1 when stored, -1 when
+ * path exists, 0 on failure */
+static int store_shared_image(mz_zip_archive *zip, mz_uint index, const char *path) {
+    char tmp_path[1024 + 8];
+    FILE *img_file;
+    int ret;
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return 0;
+    }
+    if (!(img_file = fdopen(fd, "wb"))) {
+        close(fd);
+        remove(tmp_path);
+        return 0;
+    }
+    int ok = mz_zip_reader_extract_to_cfile(zip, index, img_file, 0);
+    if (fclose(img_file) != 0) {
+        ok = 0;
+    }
+    /* mkstemp creates 0600 files, media is meant to be shared */
+    if (!ok || chmod(tmp_path, 0644) != 0) {
+        ret = 0;
+    } else if (link(tmp_path, path) == 0) {
+        ret = 1;
+    } else {
+        ret = errno == EEXIST ? -1 : 0;
+    }
+    remove(tmp_path);
+    return ret;
+}
+
+/* Name of archive entry index in the shared media directory. The CRC32
+ * and size from the central directory make the name, so an image is only
+ * inflated when a file by that name is there to be compared with, or to
+ * be written; an image that differs from it goes to <crc>-<size>-<n> */
+static char *shared_image_name(md_context *ctx, mz_uint index, const char *ext) {
+    mz_zip_archive_file_stat st;
+    char name[64], path[1024];
+    struct stat sb;
+    
+    if (!mz_zip_reader_file_stat(ctx->zip, index, &st)) {
+        return NULL;
+    }
+    for (int n = 0; n < 100; n++) {
+        int len = n ? snprintf(name, sizeof(name), "%08lx-%llu-%d%s", (unsigned long)st.m_crc32,
+                               (unsigned long long)st.m_uncomp_size, n, ext)
+                    : snprintf(name, sizeof(name), "%08lx-%llu%s", (unsigned long)st.m_crc32,
+                               (unsigned long long)st.m_uncomp_size, ext);
+        if (strlen(ctx->output_dir) + len + 2 > sizeof(path)) {
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/%s", ctx->output_dir, name);
+        if (stat(path, &sb) != 0) {
+            int stored = store_shared_image(ctx->zip, index, path);
+            if (stored > 0) {
+                return arena_strdup(ctx->dt, name);
+            }
+            if (stored == 0) {
+                dt_error(ctx->dt, DOCTXT_EIO, "Failed to write image: %s", path);
+                return NULL;
             }
         }
+        if (same_image(ctx->zip, index, st.m_uncomp_size, path)) {
+            return arena_strdup(ctx->dt, name);
+        }
     }
+    return NULL;
+}
+
+/* Image writers run on their own readers over the same archive bytes and
+ * use miniz's default allocator, since the caller's allocator is only
+ * promised to be used from one thread */
+static void *image_worker(void *arg) {
+    image_pool *pool = arg;
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    int ok = mz_zip_reader_init_mem(&zip, pool->docx, pool->size, 0);
     
-    /* Update actual count to reflect successful allocations */
-    ctx->image_rel_count = idx;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->done) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        image_job job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % IMAGE_QUEUE;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+        
+        if (!ok || !write_image(&zip, &job)) {
+            pthread_mutex_lock(&pool->lock);
+            if (!pool->failed) {
+                pool->failed = job.path;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
     
-    free(nodes);
-    free(xml_data);
-    remove(temp_path);
+    if (ok) {
+        mz_zip_reader_end(&zip);
+    }
+    return NULL;
 }
 
-/* Free image relationships */
-static void free_image_rels(md_context *ctx) {
-    if (ctx->image_rels) {
-        for (int i = 0; i < ctx->image_rel_count; i++) {
-            free(ctx->image_rels[i].rel_id);
-            free(ctx->image_rels[i].target);
+/* Start the image writers on the first image, called with the lock
+ * held; returns 0 when no thread could be started and images are
+ * written inline instead */
+static int start_image_pool(image_pool *pool) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    for (pool->nthreads = 0; pool->nthreads < MIN(MAX(n, 1), IMAGE_THREADS); pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, image_worker, pool) != 0) {
+            break;
         }
-        free(ctx->image_rels);
-        ctx->image_rels = NULL;
-        ctx->image_rel_count = 0;
     }
+    if (pool->nthreads == 0) {
+        return 0;
+    }
+    pool->started = 1;
+    return 1;
 }
 
-/* Find image target by relationship ID */
-static const char *find_image_target(md_context *ctx, const char *rel_id) {
-    for (int i = 0; i < ctx->image_rel_count; i++) {
-        if (strcmp(ctx->image_rels[i].rel_id, rel_id) == 0) {
-            return ctx->image_rels[i].target;
+/* Let the writers drain the queue and join them */
+static void finish_image_pool(md_context *ctx) {
+    image_pool *pool = ctx->pool;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->started) {
+        for (int i = 0; i < pool->nthreads; i++) {
+            pthread_join(pool->threads[i], NULL);
         }
+        pool->started = 0;
+    }
+    
+    if (pool->failed) {
+        dt_error(ctx->dt, DOCTXT_EIO, "Failed to write image: %s", pool->failed);
     }
-    return NULL;
 }
 
-/* Extract image from ZIP to output directory */
+/* Write image archive entry index to path, queued to the writers when
+ * they are running */
+static void queue_image(md_context *ctx, mz_uint index, const char *path) {
+    image_pool *pool = ctx->pool;
+    image_job job = { index, path };
+    
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->started && !pool->inline_only && !start_image_pool(pool)) {
+        pool->inline_only = 1;
+    }
+    if (pool->inline_only) {
+        pthread_mutex_unlock(&pool->lock);
+        if (!write_image(ctx->zip, &job)) {
+            dt_error(ctx->dt, DOCTXT_EIO, "Failed to write image: %s", path);
+        }
+        return;
+    }
+    
+    while (pool->count == IMAGE_QUEUE) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    pool->jobs[(pool->head + pool->count) % IMAGE_QUEUE] = job;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Extract image from ZIP to output directory; the file is written in the
+ * background and only its name is returned */
 static char *extract_image(md_context *ctx, const char *target) {
     /* Build the full path in the ZIP archive - validate length */
     /* Buffer is 512 bytes, need room for "word/" (5 chars) + target + null terminator */
@@ -271,13 +741,6 @@ static char *extract_image(md_context *ctx, const char *target) {
         return NULL;
     }
     
-    /* Extract to heap */
-    size_t file_size;
-    void *file_data = mz_zip_reader_extract_to_heap(ctx->zip, file_index, &file_size, 0);
-    if (!file_data) {
-        return NULL;
-    }
-    
     /* Get just the filename from the target path */
     const char *filename = strrchr(target, '/');
     if (!filename) {
@@ -286,44 +749,57 @@ static char *extract_image(md_context *ctx, const char *target) {
         filename++; /* Skip the '/' */
     }
     
-    /* Build output path */
-    char output_path[1024];
+    /* Without an output directory the image is only referenced */
+    if (!ctx->output_dir) {
+        return arena_strdup(ctx->dt, filename);
+    }
+    
+    /* Shared media is written, or found, before it is linked; it is
+     * linked through link_dir when set, through its directory otherwise */
+    if (ctx->shared_media) {
+        const char *ext = strrchr(filename, '.');
+        if (!ext || strlen(ext) > 16) {
+            ext = "";
+        }
+        char *name = shared_image_name(ctx, file_index, ext);
+        const char *dir = ctx->link_dir ? ctx->link_dir : ctx->output_dir;
+        if (!name || !*dir) {
+            return name;
+        }
+        char *link = arena_alloc(ctx->dt, strlen(dir) + strlen(name) + 2);
+        if (link) {
+            sprintf(link, "%s/%s", dir, name);
+        }
+        return link;
+    }
     
     /* Validate combined path length */
-    /* output_path buffer is 1024 bytes, need room for dir + "/" + filename + null */
-    size_t output_dir_len = ctx->output_dir ? strlen(ctx->output_dir) : 0;
+    /* Paths are limited to 1024 bytes, need room for dir + "/" + filename + null */
+    size_t output_dir_len = strlen(ctx->output_dir);
     size_t filename_len = strlen(filename);
-    if (output_dir_len + filename_len + 2 > sizeof(output_path) - 1) {
+    if (output_dir_len + filename_len + 2 > 1024 - 1) {
         /* Combined path too long */
-        mz_free(file_data);
         return NULL;
     }
     
-    /* Build the actual output path */
-    if (ctx->output_dir && ctx->output_dir[0] != '\0') {
-        snprintf(output_path, sizeof(output_path), "%s/%s", ctx->output_dir, filename);
-    } else {
-        snprintf(output_path, sizeof(output_path), "%s", filename);
-    }
-    
-    /* Write the image file */
-    FILE *img_file = fopen(output_path, "wb");
-    if (!img_file) {
-        mz_free(file_data);
-        return NULL;
+    /* An image used more than once is written once, whichever chunk
+     * gets to it first */
+    pthread_mutex_lock(&ctx->pool->lock);
+    int first = !ctx->pool->written[file_index];
+    ctx->pool->written[file_index] = 1;
+    pthread_mutex_unlock(&ctx->pool->lock);
+    if (first) {
+        /* The path must outlive this call, the writers read it later */
+        char *output_path = arena_alloc(ctx->dt, output_dir_len + filename_len + 2);
+        if (!output_path) {
+            return NULL;
+        }
+        snprintf(output_path, output_dir_len + filename_len + 2, "%s/%s", ctx->output_dir, filename);
+        queue_image(ctx, file_index, output_path);
     }
     
-    fwrite(file_data, 1, file_size, img_file);
-    fclose(img_file);
-    mz_free(file_data);
-    
-    /* Return just the filename for markdown */
-    char *result = strdup(filename);
-    if (!result) {
-        /* Allocation failure - remove the written file to maintain consistency */
-        remove(output_path);
-    }
-    return result;
+    /* Other images sit next to the markdown */
+    return arena_strdup(ctx->dt, filename);
 }
 
 /* Process a drawing element (image) */
@@ -363,149 +839,201 @@ static void process_drawing(struct txml_node *drawing, md_context *ctx) {
     }
     
     /* Output markdown image syntax */
-    fprintf(ctx->output, "![%s](%s)", alt_text, image_filename);
-    
-    free(image_filename);
+    out_printf(ctx->dt, "![%s](%s)", alt_text, image_filename);
 }
 
-/* Check if text run has formatting */
-static void check_run_formatting(struct txml_node *run, md_context *ctx) {
-    struct txml_node *rPr = txml_find(run, NULL, TXML_ELEMENT, "w:rPr", NULL, 0);
-    if (!rPr) return;
-    
-    ctx->in_bold = txml_find(rPr, NULL, TXML_ELEMENT, "w:b", NULL, 0) != NULL;
-    ctx->in_italic = txml_find(rPr, NULL, TXML_ELEMENT, "w:i", NULL, 0) != NULL;
-    ctx->in_strikethrough = txml_find(rPr, NULL, TXML_ELEMENT, "w:strike", NULL, 0) != NULL;
-    ctx->in_underline = txml_find(rPr, NULL, TXML_ELEMENT, "w:u", NULL, 0) != NULL;
-    
-    struct txml_node *rStyle = txml_find(rPr, NULL, TXML_ELEMENT, "w:rStyle", NULL, 0);
-    if (rStyle) {
-        struct txml_node *val_attr = txml_find(rStyle, NULL, TXML_ATTRIBUTE, "w:val", NULL, 0);
-        if (val_attr && val_attr->value && strcmp(val_attr->value, "CodeChar") == 0) {
-            ctx->in_code = 1;
-        }
+/* Elements process_run() looks at, told apart by their first letter
+ * after the "w:" prefix so the inner loop needs at most one strcmp */
+enum run_tag {
+    TAG_OTHER,
+    TAG_RPR,
+    TAG_T,
+    TAG_BR,
+    TAG_DRAWING,
+    TAG_B,
+    TAG_I,
+    TAG_STRIKE,
+    TAG_U,
+    TAG_RSTYLE
+};
+
+static enum run_tag run_tag(const char *name) {
+    if (name[0] != 'w' || name[1] != ':') return TAG_OTHER;
+    name += 2;
+    switch (name[0]) {
+    case 'b': return !name[1] ? TAG_B : strcmp(name, "br") == 0 ? TAG_BR : TAG_OTHER;
+    case 'd': return strcmp(name, "drawing") == 0 ? TAG_DRAWING : TAG_OTHER;
+    case 'i': return !name[1] ? TAG_I : TAG_OTHER;
+    case 'r': return strcmp(name, "rPr") == 0 ? TAG_RPR :
+                     strcmp(name, "rStyle") == 0 ? TAG_RSTYLE : TAG_OTHER;
+    case 's': return strcmp(name, "strike") == 0 ? TAG_STRIKE : TAG_OTHER;
+    case 't': return !name[1] ? TAG_T : TAG_OTHER;
+    case 'u': return !name[1] ? TAG_U : TAG_OTHER;
+    }
+    return TAG_OTHER;
+}
+
+/* w:val of a run property; txml stores attributes right after their element */
+static const char *prop_val(struct txml_node *prop) {
+    for (struct txml_node *attr = prop + 1; attr->type == TXML_ATTRIBUTE && attr->parent == prop; attr++) {
+        if (strcmp(attr->name, "w:val") == 0) return attr->value;
     }
+    return NULL;
+}
+
+/* Toggle properties such as <w:b w:val="0"/> switch formatting off */
+static int prop_off(const char *val) {
+    return val && (strcmp(val, "0") == 0 || strcmp(val, "false") == 0 || strcmp(val, "off") == 0);
 }
 
 /* Process a text run (w:r) */
 static void process_run(struct txml_node *run, md_context *ctx) {
-    int old_bold = ctx->in_bold;
-    int old_italic = ctx->in_italic;
-    int old_code = ctx->in_code;
-    int old_strike = ctx->in_strikethrough;
-    
-    check_run_formatting(run, ctx);
+    struct txml_node *rPr = NULL, *text_node = NULL, *br = NULL, *drawing = NULL;
+    unsigned format = 0;
+    
+    /* One pass over the run's subtree, which is contiguous in the node
+     * array: the first node whose parent precedes the run is past it */
+    for (struct txml_node *node = run + 1; node->type != TXML_EOF && node->parent >= run; node++) {
+        if (node->type != TXML_ELEMENT) continue;
+        if (node->parent == run) {
+            switch (run_tag(node->name)) {
+            case TAG_RPR: if (!rPr) rPr = node; break;
+            case TAG_T: if (!text_node) text_node = node; break;
+            case TAG_BR: if (!br) br = node; break;
+            case TAG_DRAWING: if (!drawing) drawing = node; break;
+            default: break;
+            }
+        } else if (node->parent == rPr) {
+            const char *val = prop_val(node);
+            switch (run_tag(node->name)) {
+            case TAG_B: if (!prop_off(val)) format |= FMT_BOLD; break;
+            case TAG_I: if (!prop_off(val)) format |= FMT_ITALIC; break;
+            case TAG_STRIKE: if (!prop_off(val)) format |= FMT_STRIKE; break;
+            case TAG_U: if (!val || strcmp(val, "none") != 0) format |= FMT_UNDERLINE; break;
+            case TAG_RSTYLE: if (val && strcmp(val, "CodeChar") == 0) format |= FMT_CODE; break;
+            default: break;
+            }
+        }
+    }
     
     /* Check for drawing (image) first */
-    struct txml_node *drawing = txml_find(run, NULL, TXML_ELEMENT, "w:drawing", NULL, 0);
     if (drawing) {
         process_drawing(drawing, ctx);
-        /* Reset to old state */
-        ctx->in_bold = old_bold;
-        ctx->in_italic = old_italic;
-        ctx->in_code = old_code;
-        ctx->in_strikethrough = old_strike;
         return;
     }
     
-    /* Extract text content first to check if run is empty */
-    struct txml_node *text_node = txml_find(run, NULL, TXML_ELEMENT, "w:t", NULL, 0);
-    char *unescaped = NULL;
-    int has_text = 0;
-    
-    if (text_node && text_node->value) {
-        unescaped = xml_unescape(text_node->value);
-        if (unescaped && unescaped[0] != '\0') {
-            has_text = 1;
-        }
-    }
-    
-    /* Check for line break */
-    struct txml_node *br = txml_find(run, NULL, TXML_ELEMENT, "w:br", NULL, 0);
-    
-    /* Skip empty runs (no text and no line break), but reset to old state */
+    /* Skip empty runs (no text and no line break) */
+    char *unescaped = text_node && text_node->value ? xml_unescape(ctx, text_node->value) : NULL;
+    int has_text = unescaped && unescaped[0] != '\0';
     if (!has_text && !br) {
-        if (unescaped) free(unescaped);
-        /* Reset formatting to old state since we're skipping this run */
-        ctx->in_bold = old_bold;
-        ctx->in_italic = old_italic;
-        ctx->in_code = old_code;
-        ctx->in_strikethrough = old_strike;
         return;
     }
     
     /* Open formatting markers only if run has content */
-    if (ctx->in_strikethrough && !old_strike) fprintf(ctx->output, "~~");
-    if (ctx->in_bold && !old_bold) fprintf(ctx->output, "**");
-    if (ctx->in_italic && !old_italic) fprintf(ctx->output, "*");
-    if (ctx->in_code && !old_code) fprintf(ctx->output, "`");
+    if (format & FMT_STRIKE) out_puts(ctx->dt, "~~");
+    if (format & FMT_BOLD) out_puts(ctx->dt, "**");
+    if (format & FMT_ITALIC) out_puts(ctx->dt, "*");
+    if (format & FMT_CODE) out_puts(ctx->dt, "`");
     
     /* Output text content */
-    if (has_text && unescaped) {
-        fprintf(ctx->output, "%s", unescaped);
-        free(unescaped);
+    if (has_text) {
+        out_puts(ctx->dt, unescaped);
     }
     
     if (br) {
-        fprintf(ctx->output, "  \n");
+        out_puts(ctx->dt, "  \n");
     }
     
     /* Close formatting markers in reverse order */
-    if (ctx->in_code && !old_code) fprintf(ctx->output, "`");
-    if (ctx->in_italic && !old_italic) fprintf(ctx->output, "*");
-    if (ctx->in_bold && !old_bold) fprintf(ctx->output, "**");
-    if (ctx->in_strikethrough && !old_strike) fprintf(ctx->output, "~~");
+    if (format & FMT_CODE) out_puts(ctx->dt, "`");
+    if (format & FMT_ITALIC) out_puts(ctx->dt, "*");
+    if (format & FMT_BOLD) out_puts(ctx->dt, "**");
+    if (format & FMT_STRIKE) out_puts(ctx->dt, "~~");
+}
+
+/* Whether a list paragraph is numbered, from its own w:numPr or its
+ * style's; returns 0 when it is no list item, 1 when it is */
+static int list_item(md_context *ctx, struct txml_node *para, const char *style_id,
+                     int *ilvl, int *ordered) {
+    const style *st = style_id ? id_table_find(&ctx->styles, style_id) : NULL;
+    const char *num_id = st ? st->num_id : NULL;
+    *ilvl = st ? st->ilvl : 0;
+    
+    struct txml_node *pPr = txml_find(para, NULL, TXML_ELEMENT, "w:pPr", NULL, 0);
+    struct txml_node *numPr = pPr ? txml_find(pPr, NULL, TXML_ELEMENT, "w:numPr", NULL, 0) : NULL;
+    if (numPr) {
+        const char *own_id = child_val(numPr, "w:numId");
+        const char *own_lvl = child_val(numPr, "w:ilvl");
+        if (own_id) num_id = own_id;
+        if (own_lvl) *ilvl = list_level(own_lvl);
+    }
     
-    /* Reset to old state */
-    ctx->in_bold = old_bold;
-    ctx->in_italic = old_italic;
-    ctx->in_code = old_code;
-    ctx->in_strikethrough = old_strike;
+    /* numId 0 removes inherited numbering */
+    const numbering *num = num_id ? id_table_find(&ctx->lists, num_id) : NULL;
+    if (!num) return 0;
+    *ordered = (num->ordered >> *ilvl) & 1;
+    return 1;
+}
+
+/* Whether the paragraph text starts with a typed-in number such as "2. "
+ * or "3)", which is then its list marker */
+static int typed_number(struct txml_node *para) {
+    struct txml_node *text = txml_find(para, NULL, TXML_ELEMENT, "w:t", NULL, 1);
+    const char *s = text ? text->value : NULL;
+    if (!s || !isdigit((unsigned char)*s)) return 0;
+    
+    while (isdigit((unsigned char)*s)) s++;
+    return (*s == '.' || *s == ')') && (s[1] == ' ' || !s[1]);
+}
+
+/* Code block - runs are emitted verbatim */
+static void process_code_paragraph(struct txml_node *para, md_context *ctx) {
+    out_puts(ctx->dt, "```\n");
+    struct txml_node *run = NULL;
+    while ((run = txml_find(para, run, TXML_ELEMENT, "w:r", NULL, 0))) {
+        struct txml_node *text_node = txml_find(run, NULL, TXML_ELEMENT, "w:t", NULL, 0);
+        if (text_node && text_node->value) {
+            char *unescaped = xml_unescape(ctx, text_node->value);
+            if (unescaped) {
+                out_puts(ctx->dt, unescaped);
+            }
+        }
+    }
+    out_puts(ctx->dt, "\n```\n\n");
 }
 
 /* Process a paragraph (w:p) */
 static void process_paragraph(struct txml_node *para, md_context *ctx) {
     const char *style = get_paragraph_style(para);
+    unsigned char level = 0;
     
-    /* Handle headings */
-    if (style) {
-        if (strcmp(style, "Heading1") == 0) {
-            fprintf(ctx->output, "# ");
-        } else if (strcmp(style, "Heading2") == 0) {
-            fprintf(ctx->output, "## ");
-        } else if (strcmp(style, "Heading3") == 0) {
-            fprintf(ctx->output, "### ");
-        } else if (strcmp(style, "Heading4") == 0) {
-            fprintf(ctx->output, "#### ");
-        } else if (strcmp(style, "Heading5") == 0) {
-            fprintf(ctx->output, "##### ");
-        } else if (strcmp(style, "Heading6") == 0) {
-            fprintf(ctx->output, "###### ");
-        } else if (strcmp(style, "Code") == 0) {
-            /* Code block - process differently */
-            fprintf(ctx->output, "```\n");
-            struct txml_node *run = NULL;
-            while ((run = txml_find(para, run, TXML_ELEMENT, "w:r", NULL, 0))) {
-                struct txml_node *text_node = txml_find(run, NULL, TXML_ELEMENT, "w:t", NULL, 0);
-                if (text_node && text_node->value) {
-                    char *unescaped = xml_unescape(text_node->value);
-                    if (unescaped) {
-                        fprintf(ctx->output, "%s", unescaped);
-                        free(unescaped);
-                    }
-                }
-            }
-            fprintf(ctx->output, "\n```\n\n");
-            return;
-        }
+    int kind = classify_paragraph(ctx, style, &level);
+    int ilvl, ordered;
+    
+    if (kind == STYLE_CODE) {
+        process_code_paragraph(para, ctx);
+        return;
     }
     
     /* Check for horizontal rule */
     if (has_horizontal_rule(para)) {
-        fprintf(ctx->output, "---\n\n");
+        out_puts(ctx->dt, "---\n\n");
         return;
     }
     
+    if (kind == STYLE_HEADING) {
+        out_write(ctx->dt, "######", level);
+        out_puts(ctx->dt, " ");
+    } else if (kind == STYLE_QUOTE) {
+        out_puts(ctx->dt, "> ");
+    } else if (list_item(ctx, para, style, &ilvl, &ordered)) {
+        /* Nested levels are indented past the widest marker */
+        out_write(ctx->dt, "                                ", ilvl * 4);
+        if (!typed_number(para)) {
+            out_puts(ctx->dt, ordered ? "1. " : "- ");
+        }
+    }
+    
     /* Process all runs in the paragraph */
     struct txml_node *run = NULL;
     int has_content = 0;
@@ -516,7 +1044,7 @@ static void process_paragraph(struct txml_node *para, md_context *ctx) {
     
     /* End paragraph with double newline if it had content */
     if (has_content || style) {
-        fprintf(ctx->output, "\n\n");
+        out_puts(ctx->dt, "\n\n");
     }
 }
 
@@ -538,17 +1066,17 @@ static void process_table(struct txml_node *table, md_context *ctx) {
     /* Process all rows */
     struct txml_node *row = NULL;
     while ((row = txml_find(table, row, TXML_ELEMENT, "w:tr", NULL, 0))) {
-        fprintf(ctx->output, "|");
+        out_puts(ctx->dt, "|");
         
         struct txml_node *cell = NULL;
         while ((cell = txml_find(row, cell, TXML_ELEMENT, "w:tc", NULL, 0))) {
-            fprintf(ctx->output, " ");
+            out_puts(ctx->dt, " ");
             
             /* Process all paragraphs in the cell */
             struct txml_node *para = NULL;
             int first_para = 1;
             while ((para = txml_find(cell, para, TXML_ELEMENT, "w:p", NULL, 0))) {
-                if (!first_para) fprintf(ctx->output, " ");
+                if (!first_para) out_puts(ctx->dt, " ");
                 first_para = 0;
                 
                 struct txml_node *run = NULL;
@@ -557,151 +1085,285 @@ static void process_table(struct txml_node *table, md_context *ctx) {
                 }
             }
             
-            fprintf(ctx->output, " |");
+            out_puts(ctx->dt, " |");
         }
         
-        fprintf(ctx->output, "\n");
+        out_puts(ctx->dt, "\n");
         
         /* Add separator row after header */
         if (ctx->first_table_row) {
-            fprintf(ctx->output, "|");
+            out_puts(ctx->dt, "|");
             for (int i = 0; i < ctx->table_col_count; i++) {
-                fprintf(ctx->output, "---------|");
+                out_puts(ctx->dt, "---------|");
             }
-            fprintf(ctx->output, "\n");
+            out_puts(ctx->dt, "\n");
             ctx->first_table_row = 0;
         }
     }
     
-    fprintf(ctx->output, "\n");
+    out_puts(ctx->dt, "\n");
     ctx->in_table = 0;
 }
 
-/* Convert DOCX to Markdown */
-static void convert_docx_to_md(const char *input_path, const char *output_path) {
-    const char *temp_file = get_temp_file_path();
-    
-    /* Open ZIP archive for image extraction */
-    mz_zip_archive zip;
-    memset(&zip, 0, sizeof(zip));
-    
-    if (!mz_zip_reader_init_file(&zip, input_path, 0)) {
-        die("Failed to open DOCX file: %s", input_path);
+/* Convert paragraphs and tables in document order */
+static void convert_children(md_context *ctx, struct txml_node **children, size_t count) {
+    for (size_t i = 0; i < count && !ctx->dt->err; i++) {
+        if (strcmp(children[i]->name, "w:p") == 0) {
+            process_paragraph(children[i], ctx);
+        } else {
+            process_table(children[i], ctx);
+        }
     }
-    
-    /* Extract document.xml from DOCX */
-    int file_index = mz_zip_reader_locate_file(&zip, "word/document.xml", NULL, 0);
-    if (file_index < 0) {
-        mz_zip_reader_end(&zip);
-        die("Failed to find document.xml in: %s", input_path);
+}
+
+static void *chunk_worker(void *arg) {
+    body_chunk *c = arg;
+    convert_children(&c->ctx, c->children, c->count);
+    return NULL;
+}
+
+/* Start a chunk on its own context and archive reader; both use the
+ * default allocator, since the caller's is only promised to be used
+ * from one thread. A chunk that does not start runs on the caller's
+ * thread instead */
+static void start_chunk(body_chunk *c, const md_context *base) {
+    if (!(c->dt = doctxt_new(NULL))) {
+        return;
     }
-    
-    size_t file_size;
-    void *file_data = mz_zip_reader_extract_to_heap(&zip, file_index, &file_size, 0);
-    if (!file_data) {
-        mz_zip_reader_end(&zip);
-        die("Failed to extract document.xml from: %s", input_path);
+    dt_begin(c->dt);
+    memset(&c->zip, 0, sizeof(c->zip));
+    if (!mz_zip_reader_init_mem(&c->zip, base->pool->docx, base->pool->size, 0)) {
+        return;
+    }
+    c->ctx = *base;
+    c->ctx.dt = c->dt;
+    c->ctx.zip = &c->zip;
+    if (pthread_create(&c->thread, NULL, chunk_worker, c) != 0) {
+        mz_zip_reader_end(&c->zip);
+        return;
+    }
+    c->running = 1;
+}
+
+/* Convert the body and wait for its images. Large documents are split
+ * into contiguous chunks on separate threads; paragraph and table state
+ * does not outlive a body child, so chunk outputs only need to be
+ * concatenated in order */
+static void convert_body(md_context *ctx, struct txml_node **children, size_t count) {
+    size_t nchunks = MIN(MIN((size_t)dt_threads(ctx->dt), MAX_CHUNKS), count / CHUNK_MIN);
+    body_chunk *chunks = NULL;
+    
+    if (nchunks >= 2 && (chunks = arena_alloc(ctx->dt, nchunks * sizeof(*chunks)))) {
+        memset(chunks, 0, nchunks * sizeof(*chunks));
+        for (size_t i = 0; i < nchunks; i++) {
+            chunks[i].children = children + count * i / nchunks;
+            chunks[i].count = count * (i + 1) / nchunks - count * i / nchunks;
+        }
+        for (size_t i = 1; i < nchunks; i++) {
+            start_chunk(&chunks[i], ctx);
+        }
+        
+        /* The first chunk runs here, straight into the caller's output */
+        convert_children(ctx, chunks[0].children, chunks[0].count);
+        for (size_t i = 1; i < nchunks; i++) {
+            body_chunk *c = &chunks[i];
+            if (!c->running) {
+                convert_children(ctx, c->children, c->count);
+                continue;
+            }
+            pthread_join(c->thread, NULL);
+            mz_zip_reader_end(&c->zip);
+            if (c->dt->err) {
+                dt_error(ctx->dt, c->dt->err, "%s", doctxt_errmsg(c->dt));
+            } else if (!ctx->dt->err) {
+                out_write(ctx->dt, c->dt->out, c->dt->outlen);
+            }
+        }
+    } else if (nchunks < 2) {
+        convert_children(ctx, children, count);
     }
     
-    FILE *temp = fopen(temp_file, "wb");
-    if (!temp) {
-        mz_free(file_data);
-        mz_zip_reader_end(&zip);
-        die("Failed to create temporary file: %s", temp_file);
+    /* Queued image paths live in the chunk arenas */
+    finish_image_pool(ctx);
+    for (size_t i = 1; chunks && i < nchunks; i++) {
+        doctxt_free(chunks[i].dt);
     }
+}
+
+/* Link shared media through dir in the documents converted on dt from
+ * now on */
+int doctxt_set_link_dir(doctxt_ctx *dt, const char *dir) {
+    char *copy = NULL;
+    
+    dt_begin(dt);
+    if (dir && !(copy = dt_malloc(dt, strlen(dir) + 1))) {
+        return dt->err;
+    }
+    if (copy) {
+        strcpy(copy, dir);
+    }
+    dt_free(dt, dt->link_dir);
+    dt->link_dir = copy;
+    return DOCTXT_OK;
+}
+
+/* Convert DOCX to Markdown */
+int doctxt_docx_to_md(doctxt_ctx *dt, const void *docx, size_t size, const char *imgdir,
+                      int flags, const char **out, size_t *outsize) {
+    dt_begin(dt);
     
-    fwrite(file_data, 1, file_size, temp);
-    fclose(temp);
-    mz_free(file_data);
+    /* Open ZIP archive for image extraction */
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    DT_ZIP_ALLOC(&zip, dt);
     
-    /* Parse XML */
-    struct txml_node *nodes = NULL;
-    char *xml_data = txml_parse_file((char *)temp_file, &nodes);  /* txml_parse_file modifies path string */
-    if (!xml_data) {
-        mz_zip_reader_end(&zip);
-        die("Failed to parse document XML");
+    if (!mz_zip_reader_init_mem(&zip, docx, size, 0)) {
+        dt_error(dt, DOCTXT_EZIP, "Failed to open DOCX archive");
+        return dt_end(dt, out, outsize);
     }
     
-    /* Open output file */
-    FILE *output = fopen(output_path, "w");
-    if (!output) {
-        free(nodes);
-        free(xml_data);
+    /* Extract document.xml from DOCX and parse it in place */
+    size_t xml_size;
+    char *xml = dt_zip_part(dt, &zip, "word/document.xml", &xml_size);
+    if (!xml) {
         mz_zip_reader_end(&zip);
-        die("Failed to open output file: %s", output_path);
+        dt_error(dt, DOCTXT_ENOPART, "Failed to find document.xml in archive");
+        return dt_end(dt, out, outsize);
     }
     
-    /* Extract output directory from output path */
-    char output_dir[1024] = "";
-    const char *last_slash = strrchr(output_path, '/');
-    if (last_slash) {
-        size_t dir_len = last_slash - output_path;
-        if (dir_len > 0 && dir_len < sizeof(output_dir) - 1) {
-            memcpy(output_dir, output_path, dir_len);
-            output_dir[dir_len] = '\0';
-        }
+    struct txml_node *nodes = dt_parse_xml(dt, xml, xml_size);
+    if (!nodes) {
+        mz_zip_reader_end(&zip);
+        dt_error(dt, DOCTXT_EXML, "Failed to parse document XML");
+        return dt_end(dt, out, outsize);
     }
     
     /* Initialize context */
     md_context ctx = {0};
-    ctx.output = output;
+    image_pool pool = {0};
+    ctx.dt = dt;
     ctx.zip = &zip;
-    ctx.output_dir = output_dir[0] ? output_dir : NULL;
-    
-    /* Parse relationships to find image mappings */
-    parse_relationships(input_path, &ctx);
+    ctx.output_dir = imgdir;
+    ctx.shared_media = imgdir && (flags & DOCTXT_SHARED_MEDIA);
+    ctx.link_dir = dt->link_dir;
+    ctx.pool = &pool;
+    pool.docx = docx;
+    pool.size = size;
+    
+    ctx.rels.entry_size = sizeof(relationship);
+    ctx.styles.entry_size = sizeof(style);
+    ctx.lists.entry_size = sizeof(numbering);
+    
+    /* Parse relationships to resolve images, styles and numbering to
+     * classify paragraphs */
+    parse_relationships(&ctx);
+    parse_styles(&ctx);
+    parse_numbering(&ctx);
     
     /* Find document body */
     struct txml_node *body = txml_find(nodes, NULL, TXML_ELEMENT, "w:body", NULL, 1);
     if (!body) {
-        fclose(output);
-        free(nodes);
-        free(xml_data);
-        free_image_rels(&ctx);
         mz_zip_reader_end(&zip);
-        die("No w:body element found in document");
+        dt_error(dt, DOCTXT_EXML, "No w:body element found in document");
+        return dt_end(dt, out, outsize);
     }
     
-    /* Process document content in order - paragraphs and tables 
+    /* Collect paragraphs and tables in document order
      * Note: We use pointer arithmetic here because txml stores nodes in a contiguous array.
      * This is the documented way to traverse nodes in document order.
      * Using txml_find() would not preserve the interleaved order of paragraphs and tables.
      */
-    struct txml_node *child = body + 1;
-    while (child && child->type != TXML_EOF) {
+    size_t count = 0, cap = 0;
+    struct txml_node **children = NULL;
+    for (struct txml_node *child = body + 1; child->type != TXML_EOF && child->parent >= body; child++) {
         /* Check if this node is a direct child of body */
-        if (child->parent == body && child->type == TXML_ELEMENT) {
-            if (strcmp(child->name, "w:p") == 0) {
-                process_paragraph(child, &ctx);
-            } else if (strcmp(child->name, "w:tbl") == 0) {
-                process_table(child, &ctx);
+        if (child->parent == body && child->type == TXML_ELEMENT &&
+            (strcmp(child->name, "w:p") == 0 || strcmp(child->name, "w:tbl") == 0)) {
+            if (count == cap) {
+                size_t ncap = cap ? cap * 2 : 256;
+                children = arena_grow(dt, children, cap * sizeof(*children), ncap * sizeof(*children));
+                if (!children) {
+                    break;
+                }
+                cap = ncap;
             }
+            children[count++] = child;
         }
-        child++;
     }
     
-    /* Cleanup */
-    fclose(output);
-    free(nodes);
-    free(xml_data);
-    free_image_rels(&ctx);
+    /* Images shared between chunks are written once */
+    size_t nfiles = mz_zip_reader_get_num_files(&zip);
+    if (children && (pool.written = arena_alloc(dt, nfiles + 1))) {
+        memset(pool.written, 0, nfiles + 1);
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.not_empty, NULL);
+        pthread_cond_init(&pool.not_full, NULL);
+        convert_body(&ctx, children, count);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.not_empty);
+        pthread_cond_destroy(&pool.not_full);
+    }
+    
+    /* Cleanup; the parts, relationships and image names go with the arena */
     mz_zip_reader_end(&zip);
-    remove(temp_file);
+    
+    return dt_end(dt, out, outsize);
 }
 
+#ifndef DOCTXT_LIB
 /* Usage information */
 static void usage(void) {
-    fprintf(stderr, "Usage: docx2md input.docx [-o output.md]\n");
+    fprintf(stderr, "Usage: docx2md input.docx [-o output.md] [-m media_dir]\n");
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -o FILE    Output file (default: output.md)\n");
+    fprintf(stderr, "  -o FILE    Output file, - for stdout (default: output.md)\n");
+    fprintf(stderr, "  -m DIR     Store images by content in DIR, shared between runs\n");
     fprintf(stderr, "  -v         Display version information\n");
     fprintf(stderr, "  -h         Display this help message\n");
+    fprintf(stderr, "\nAn input of - reads the document from stdin\n");
     exit(1);
 }
 
+/* Path of directory to as seen from directory from, both existing, ""
+ * when they are the same; NULL when either cannot be resolved */
+static char *relative_dir(const char *from, const char *to) {
+    char *f = realpath(from, NULL), *t = realpath(to, NULL), *rel = NULL;
+    
+    if (f && t) {
+        /* "" for the root, so that every component starts with '/' */
+        const char *a = strcmp(f, "/") ? f : "", *b = strcmp(t, "/") ? t : "";
+        size_t common = 0;
+        while (a[common] && a[common] == b[common]) {
+            common++;
+        }
+        /* Back to the end of the last component both share */
+        if ((a[common] && a[common] != '/') || (b[common] && b[common] != '/')) {
+            while (common > 0 && a[common] != '/') {
+                common--;
+            }
+        }
+        const char *up = a + common, *down = b + common;
+        size_t n = 0;
+        for (const char *p = up; *p; p++) {
+            n += *p == '/';
+        }
+        rel = xmalloc(3 * n + strlen(down) + 1);
+        rel[0] = '\0';
+        for (size_t i = 0; i < n; i++) {
+            strcat(rel, i ? "/.." : "..");
+        }
+        if (*down) {
+            strcat(rel, n ? down : down + 1);
+        }
+    }
+    free(f);
+    free(t);
+    return rel;
+}
+
 int main(int argc, char *argv[]) {
     char *input_file = NULL;
     char *output_file = "output.md";
+    char *media_dir = NULL;
     
     /* Parse arguments */
     for (int i = 1; i < argc; i++) {
@@ -715,7 +1377,12 @@ int main(int argc, char *argv[]) {
                 usage();
             }
             output_file = argv[++i];
-        } else if (argv[i][0] == '-') {
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (i + 1 >= argc) {
+                usage();
+            }
+            media_dir = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1]) {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             usage();
         } else {
@@ -732,7 +1399,54 @@ int main(int argc, char *argv[]) {
         usage();
     }
     
-    convert_docx_to_md(input_file, output_file);
+    size_t size;
+    char *data = readfile(input_file, &size);
+    if (!data) {
+        die("Failed to open DOCX file: %s", input_file);
+    }
+    
+    /* Images go next to the output file */
+    char output_dir[1024] = ".";
+    const char *last_slash = strrchr(output_file, '/');
+    if (last_slash) {
+        size_t dir_len = last_slash - output_file;
+        if (dir_len > 0 && dir_len < sizeof(output_dir) - 1) {
+            memcpy(output_dir, output_file, dir_len);
+            output_dir[dir_len] = '\0';
+        }
+    }
+    
+    if (media_dir && mkdir(media_dir, 0755) < 0 && errno != EEXIST) {
+        die("Failed to create media directory %s:", media_dir);
+    }
+    
+    doctxt_ctx *ctx = doctxt_new(NULL);
+    if (!ctx) {
+        die("Out of memory");
+    }
+    /* Links are read relative to the markdown, not to where we run */
+    if (media_dir && strcmp(output_file, "-") != 0) {
+        char *link_dir = relative_dir(output_dir, media_dir);
+        if (link_dir && doctxt_set_link_dir(ctx, link_dir) != DOCTXT_OK) {
+            die("Out of memory");
+        }
+        free(link_dir);
+    }
+    const char *md;
+    size_t md_size;
+    int flags = media_dir ? DOCTXT_SHARED_MEDIA : 0;
+    if (doctxt_docx_to_md(ctx, data, size, media_dir ? media_dir : output_dir, flags,
+                          &md, &md_size) != DOCTXT_OK) {
+        die("%s: %s", input_file, doctxt_errmsg(ctx));
+    }
+    
+    /* Write output file */
+    if (!writefile(output_file, md, md_size)) {
+        die("Failed to write output file: %s", output_file);
+    }
     
+    doctxt_free(ctx);
+    free(data);
     return 0;
 }
+#endif /* DOCTXT_LIB */
@@ -9,16 +9,37 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "md4c.h"
 #include "miniz.h"
+#include "doctxt.h"
 #include "util.h"
+#include "txml.h"
 
 #define VERSION_STR "0.1"
 #define MAX_BUFFER_SIZE (10 * 1024 * 1024)  // 10MB buffer for document
+#define CHUNK_MIN (256 * 1024)  /* Markdown bytes per conversion thread */
+#define MAX_CHUNKS 32
+#define MD_FLAGS (MD_FLAG_TABLES | MD_FLAG_STRIKETHROUGH | MD_FLAG_TASKLISTS | \
+                  MD_FLAG_PERMISSIVEAUTOLINKS | MD_FLAG_UNDERLINE)
+
+/* document.xml deflated piece by piece, see convert_cached() */
+typedef struct {
+    tdefl_compressor *comp;
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t xml_size;        // Size of the XML deflated so far
+    mz_ulong crc;           // And its CRC-32
+} deflated_xml;
 
 /* Context structure to hold state during parsing */
 typedef struct {
+    doctxt_ctx *dt;  // Library context: allocator, output, errors
     char *xml_buffer;
     size_t xml_size;
     size_t xml_capacity;
@@ -32,6 +53,7 @@ typedef struct {
     int image_count;
     int image_capacity;
     int next_image_id;
+    int image_base;  // Index of this context's first image in the document
     /* Track active formatting for proper nesting */
     int format_bold;
     int format_italic;
@@ -39,14 +61,18 @@ typedef struct {
     int format_strike;
     int format_underline;
     int run_has_text;  // Track if current run has any text content
+    deflated_xml *deflated;  // The whole document, when it comes from the cache
 } docx_context;
 
 /* Forward declarations */
+static int reserve_xml(docx_context *ctx, size_t len);
 static void append_xml(docx_context *ctx, const char *str);
 static void append_xml_n(docx_context *ctx, const char *str, size_t len);
 static void xml_escape_append(docx_context *ctx, const char *text, size_t size);
 static void ensure_paragraph(docx_context *ctx);
 static void close_paragraph(docx_context *ctx);
+static int list_num_id(const doctxt_ctx *dt);
+static int init_docx_context(docx_context *ctx, doctxt_ctx *dt, int image_base);
 
 /* XML escaping */
 static void xml_escape_append(docx_context *ctx, const char *text, size_t size)
@@ -59,40 +85,40 @@ static void xml_escape_append(docx_context *ctx, const char *text, size_t size)
             case '"':  append_xml(ctx, "&quot;"); break;
             case '\'': append_xml(ctx, "&apos;"); break;
             default:   
-                if (ctx->xml_size >= ctx->xml_capacity - 1) {
-                    ctx->xml_capacity *= 2;
-                    char *new_buffer = realloc(ctx->xml_buffer, ctx->xml_capacity);
-                    if (!new_buffer) die("Out of memory");
-                    ctx->xml_buffer = new_buffer;
-                }
+                if (!reserve_xml(ctx, 1)) return;
                 ctx->xml_buffer[ctx->xml_size++] = text[i];
                 break;
         }
     }
 }
 
+/* Make room for len more bytes plus a terminator; on allocation failure
+ * the error stays recorded in ctx->dt and further output is dropped */
+static int reserve_xml(docx_context *ctx, size_t len)
+{
+    if (ctx->dt->err) return 0;
+    if (ctx->xml_size + len < ctx->xml_capacity) return 1;
+    
+    size_t capacity = ctx->xml_capacity;
+    while (ctx->xml_size + len >= capacity) {
+        capacity *= 2;
+    }
+    char *new_buffer = dt_realloc(ctx->dt, ctx->xml_buffer, capacity);
+    if (!new_buffer) return 0;
+    ctx->xml_buffer = new_buffer;
+    ctx->xml_capacity = capacity;
+    return 1;
+}
+
 /* Append string to XML buffer */
 static void append_xml(docx_context *ctx, const char *str)
 {
-    size_t len = strlen(str);
-    while (ctx->xml_size + len >= ctx->xml_capacity) {
-        ctx->xml_capacity *= 2;
-        char *new_buffer = realloc(ctx->xml_buffer, ctx->xml_capacity);
-        if (!new_buffer) die("Out of memory");
-        ctx->xml_buffer = new_buffer;
-    }
-    memcpy(ctx->xml_buffer + ctx->xml_size, str, len);
-    ctx->xml_size += len;
+    append_xml_n(ctx, str, strlen(str));
 }
 
 static void append_xml_n(docx_context *ctx, const char *str, size_t len)
 {
-    while (ctx->xml_size + len >= ctx->xml_capacity) {
-        ctx->xml_capacity *= 2;
-        char *new_buffer = realloc(ctx->xml_buffer, ctx->xml_capacity);
-        if (!new_buffer) die("Out of memory");
-        ctx->xml_buffer = new_buffer;
-    }
+    if (!reserve_xml(ctx, len)) return;
     memcpy(ctx->xml_buffer + ctx->xml_size, str, len);
     ctx->xml_size += len;
 }
@@ -171,34 +197,48 @@ static void start_text_run(docx_context *ctx)
     ctx->run_has_text = 0;  // New run starts with no text
 }
 
-/* Add image to tracking list */
+/* Add image to tracking list; a NULL path keeps an index unused */
 static void add_image(docx_context *ctx, const char *path, size_t path_len)
 {
     if (ctx->image_count >= ctx->image_capacity) {
-        ctx->image_capacity = ctx->image_capacity ? ctx->image_capacity * 2 : 8;
-        char **new_paths = realloc(ctx->image_paths, ctx->image_capacity * sizeof(char*));
-        if (!new_paths) die("Out of memory");
+        int capacity = ctx->image_capacity ? ctx->image_capacity * 2 : 8;
+        char **new_paths = arena_grow(ctx->dt, ctx->image_paths,
+                                      ctx->image_capacity * sizeof(char*),
+                                      capacity * sizeof(char*));
+        if (!new_paths) return;
         ctx->image_paths = new_paths;
+        ctx->image_capacity = capacity;
     }
     
-    ctx->image_paths[ctx->image_count] = malloc(path_len + 1);
-    if (!ctx->image_paths[ctx->image_count]) die("Out of memory");
+    if (!path) {
+        ctx->image_paths[ctx->image_count++] = NULL;
+        return;
+    }
+    ctx->image_paths[ctx->image_count] = arena_alloc(ctx->dt, path_len + 1);
+    if (!ctx->image_paths[ctx->image_count]) return;
     memcpy(ctx->image_paths[ctx->image_count], path, path_len);
     ctx->image_paths[ctx->image_count][path_len] = '\0';
     ctx->image_count++;
 }
 
-/* Free image paths */
-static void free_image_paths(docx_context *ctx)
+/* Resolve the image src, len bytes, below dir into real; fails when it
+ * does not exist or leads outside dir, and always when dir is "" */
+static int image_below(const char *dir, const char *src, size_t len, char *real)
 {
-    if (ctx->image_paths) {
-        for (int i = 0; i < ctx->image_count; i++) {
-            free(ctx->image_paths[i]);
-        }
-        free(ctx->image_paths);
-        ctx->image_paths = NULL;
-        ctx->image_count = 0;
+    char path[PATH_MAX];
+    size_t dirlen = strlen(dir);
+    int n;
+    
+    if (!dirlen) {
+        return 0;
     }
+    n = src[0] == '/' ? snprintf(path, sizeof(path), "%.*s", (int)len, src) :
+                        snprintf(path, sizeof(path), "%s/%.*s", dir, (int)len, src);
+    if (n < 0 || n >= (int)sizeof(path) || memchr(src, '\0', len) || !realpath(path, real)) {
+        return 0;
+    }
+    return strncmp(real, dir, dirlen) == 0 &&
+           (dirlen == 1 || real[dirlen] == '/' || real[dirlen] == '\0');
 }
 
 /* Markdown callback: enter block */
@@ -257,7 +297,10 @@ static int enter_block_callback(MD_BLOCKTYPE type, void *detail, void *userdata)
         case MD_BLOCK_P:
             close_paragraph(ctx);
             if (ctx->in_list_item) {
-                append_xml(ctx, "<w:p><w:pPr><w:numPr><w:ilvl w:val=\"0\"/><w:numId w:val=\"1\"/></w:numPr></w:pPr>");
+                char buf[128];
+                snprintf(buf, sizeof(buf), "<w:p><w:pPr><w:numPr><w:ilvl w:val=\"0\"/><w:numId w:val=\"%d\"/></w:numPr></w:pPr>",
+                         list_num_id(ctx->dt));
+                append_xml(ctx, buf);
             } else {
                 append_xml(ctx, "<w:p>");
             }
@@ -288,7 +331,7 @@ static int enter_block_callback(MD_BLOCKTYPE type, void *detail, void *userdata)
             break;
     }
     
-    return 0;
+    return ctx->dt->err ? -1 : 0;  // abort md_parse() once a conversion error is recorded
 }
 
 /* Markdown callback: leave block */
@@ -353,7 +396,7 @@ static int leave_block_callback(MD_BLOCKTYPE type, void *detail, void *userdata)
             break;
     }
     
-    return 0;
+    return ctx->dt->err ? -1 : 0;
 }
 
 /* Markdown callback: enter span */
@@ -403,13 +446,19 @@ static int enter_span_callback(MD_SPANTYPE type, void *detail, void *userdata)
         case MD_SPAN_IMG: {
             MD_SPAN_IMG_DETAIL *img = (MD_SPAN_IMG_DETAIL *)detail;
             // Track image for embedding
-            if (img->src.size > 0) {
+            const char *dir = ctx->dt->image_dir;
+            char real[PATH_MAX];
+            if (img->src.size > 0 && (!dir || image_below(dir, img->src.text, img->src.size, real))) {
                 int current_img_index = ctx->image_count;
-                add_image(ctx, img->src.text, img->src.size);
+                if (dir) {
+                    add_image(ctx, real, strlen(real));
+                } else {
+                    add_image(ctx, img->src.text, img->src.size);
+                }
                 
                 // Embed image in document
                 // Image relationship IDs start at rId3 (rId1=styles, rId2=numbering)
-                int rel_id = current_img_index + 3;
+                int rel_id = ctx->image_base + current_img_index + 3;
                 char buf[1024];
                 int img_id = ctx->next_image_id++;
                 snprintf(buf, sizeof(buf),
@@ -465,7 +514,7 @@ static int enter_span_callback(MD_SPANTYPE type, void *detail, void *userdata)
     }
     
     ctx->para_has_content = 1;
-    return 0;
+    return ctx->dt->err ? -1 : 0;
 }
 
 /* Markdown callback: leave span */
@@ -538,7 +587,7 @@ static int leave_span_callback(MD_SPANTYPE type, void *detail, void *userdata)
             break;
     }
     
-    return 0;
+    return ctx->dt->err ? -1 : 0;
 }
 
 /* Markdown callback: text */
@@ -600,51 +649,32 @@ static int text_callback(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size, vo
             break;
     }
     
-    return 0;
+    return ctx->dt->err ? -1 : 0;
 }
 
-/* Read file into memory */
-static char *read_file(const char *filename, size_t *size)
-{
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        return NULL;
-    }
-    
-    fseek(f, 0, SEEK_END);
-    *size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    char *buffer = malloc(*size + 1);
-    if (!buffer) {
-        fclose(f);
-        return NULL;
-    }
-    
-    if (fread(buffer, 1, *size, f) != *size) {
-        free(buffer);
-        fclose(f);
-        return NULL;
-    }
-    
-    buffer[*size] = '\0';
-    fclose(f);
-    return buffer;
-}
+/* Pieces of [Content_Types].xml, shared with reference documents */
+#define CONTENT_TYPES_HEADER \
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n" \
+    "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">" \
+    "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>" \
+    "<Default Extension=\"xml\" ContentType=\"application/xml\"/>" \
+    "<Default Extension=\"png\" ContentType=\"image/png\"/>" \
+    "<Default Extension=\"jpg\" ContentType=\"image/jpeg\"/>" \
+    "<Default Extension=\"jpeg\" ContentType=\"image/jpeg\"/>"
+#define CONTENT_TYPE_DOCUMENT \
+    "<Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\"/>"
+#define CONTENT_TYPE_STYLES \
+    "<Override PartName=\"/word/styles.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.styles+xml\"/>"
+#define CONTENT_TYPE_NUMBERING \
+    "<Override PartName=\"/word/numbering.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.numbering+xml\"/>"
 
 /* Create the [Content_Types].xml file */
 static const char *get_content_types_xml(void)
 {
-    return "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
-           "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
-           "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
-           "<Default Extension=\"xml\" ContentType=\"application/xml\"/>"
-           "<Default Extension=\"png\" ContentType=\"image/png\"/>"
-           "<Default Extension=\"jpg\" ContentType=\"image/jpeg\"/>"
-           "<Default Extension=\"jpeg\" ContentType=\"image/jpeg\"/>"
-           "<Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\"/>"
-           "<Override PartName=\"/word/styles.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.styles+xml\"/>"
-           "<Override PartName=\"/word/numbering.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.numbering+xml\"/>"
+    return CONTENT_TYPES_HEADER
+           CONTENT_TYPE_DOCUMENT
+           CONTENT_TYPE_STYLES
+           CONTENT_TYPE_NUMBERING
            "</Types>";
 }
 
@@ -657,54 +687,98 @@ static const char *get_rels_xml(void)
            "</Relationships>";
 }
 
+/* A part deflated ahead of time with the settings the zip writer would
+ * use, so that writing it is a copy. One that failed to compress is
+ * written the usual way */
+typedef struct {
+    const char *name;
+    const char *xml;
+    size_t size;
+    mz_uint32 crc;
+    const unsigned char *comp;
+    size_t comp_size;       // 0 when not compressed
+} static_part;
+
+/* Template whose styles, theme, settings, headers and footers go into
+ * every document, see doctxt_set_reference_doc() */
+typedef struct {
+    char *data;             // Copy of the template, read through zip
+    mz_zip_archive zip;
+    int *parts;             // Entries copied as they are
+    int nparts;
+    int parts_capacity;
+    int styles;             // One of them is word/styles.xml
+    char *rels;             // Their relationships in document.xml.rels
+    char *sectpr;           // Page setup and header references, or NULL
+    char *types_xml;        // [Content_Types].xml covering them
+    unsigned char *types_comp;
+    static_part types;
+    char *numbering_xml;    // Its numbering.xml with our list added, or NULL
+    unsigned char *numbering_comp;
+    static_part numbering;
+    int list_id;            // w:numId of our list, after the template's
+} reference_doc;
+
+/* Template headers usually bring a word/media/image1.png of their own */
+#define MEDIA_NAME(ctx) ((ctx)->dt->ref ? "mdimage" : "image")
+
+/* Append str, growing the buffer of *capacity bytes at *xml as needed */
+static int append_rels(doctxt_ctx *dt, char **xml, size_t *len, size_t *capacity,
+                       const char *str, size_t n)
+{
+    while (*len + n >= *capacity) {
+        *capacity *= 2;
+        char *new_xml = dt_realloc(dt, *xml, *capacity);
+        if (!new_xml) {
+            dt_free(dt, *xml);
+            return 0;
+        }
+        *xml = new_xml;
+    }
+    memcpy(*xml + *len, str, n);
+    *len += n;
+    (*xml)[*len] = '\0';
+    return 1;
+}
+
 /* Create the word/_rels/document.xml.rels file */
 static char *get_document_rels_xml(docx_context *ctx)
 {
+    const reference_doc *ref = ctx->dt->ref;
     size_t capacity = 4096;
-    char *xml = malloc(capacity);
+    char *xml = dt_malloc(ctx->dt, capacity);
     if (!xml) return NULL;
     
     size_t len = snprintf(xml, capacity,
         "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
         "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
-        "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles\" Target=\"styles.xml\"/>"
-        "<Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/numbering\" Target=\"numbering.xml\"/>");
+        "%s"
+        "<Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/numbering\" Target=\"numbering.xml\"/>",
+        ref && ref->styles ? "" :
+        "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles\" Target=\"styles.xml\"/>");
     
     // Add image relationships
     for (int i = 0; i < ctx->image_count; i++) {
         char buf[512];
+        if (!ctx->image_paths[i]) continue;
         const char *ext = strrchr(ctx->image_paths[i], '.');
         if (!ext) ext = ".png";
         
         int n = snprintf(buf, sizeof(buf),
-            "<Relationship Id=\"rId%d\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/image\" Target=\"media/image%d%s\"/>",
-            i + 3, i + 1, ext);
-        
-        while (len + n >= capacity) {
-            capacity *= 2;
-            char *new_xml = realloc(xml, capacity);
-            if (!new_xml) {
-                free(xml);
-                return NULL;
-            }
-            xml = new_xml;
+            "<Relationship Id=\"rId%d\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/image\" Target=\"media/%s%d%s\"/>",
+            i + 3, MEDIA_NAME(ctx), i + 1, ext);
+        if (!append_rels(ctx->dt, &xml, &len, &capacity, buf, n)) {
+            return NULL;
         }
-        
-        memcpy(xml + len, buf, n);
-        len += n;
     }
     
+    if (ref && !append_rels(ctx->dt, &xml, &len, &capacity, ref->rels, strlen(ref->rels))) {
+        return NULL;
+    }
     const char *end = "</Relationships>";
-    while (len + strlen(end) >= capacity) {
-        capacity *= 2;
-        char *new_xml = realloc(xml, capacity);
-        if (!new_xml) {
-            free(xml);
-            return NULL;
-        }
-        xml = new_xml;
+    if (!append_rels(ctx->dt, &xml, &len, &capacity, end, strlen(end))) {
+        return NULL;
     }
-    strcpy(xml + len, end);
     
     return xml;
 }
@@ -727,44 +801,58 @@ static const char *get_styles_xml(void)
            "</w:styles>";
 }
 
+/* The list of list items, as abstract numbering and numbering instance
+ * with their IDs */
+#define LIST_ABSTRACT_NUM(id) \
+    "<w:abstractNum w:abstractNumId=\"" id "\">" \
+    "<w:multiLevelType w:val=\"hybridMultilevel\"/>" \
+    "<w:lvl w:ilvl=\"0\"><w:start w:val=\"1\"/><w:numFmt w:val=\"bullet\"/><w:lvlText w:val=\"\"/><w:lvlJc w:val=\"left\"/></w:lvl>" \
+    "</w:abstractNum>"
+#define LIST_NUM(id, abstract_id) \
+    "<w:num w:numId=\"" id "\"><w:abstractNumId w:val=\"" abstract_id "\"/></w:num>"
+
 /* Create the word/numbering.xml file for lists */
 static const char *get_numbering_xml(void)
 {
     return "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
            "<w:numbering xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\">"
-           "<w:abstractNum w:abstractNumId=\"0\">"
-           "<w:multiLevelType w:val=\"hybridMultilevel\"/>"
-           "<w:lvl w:ilvl=\"0\"><w:start w:val=\"1\"/><w:numFmt w:val=\"bullet\"/><w:lvlText w:val=\"\"/><w:lvlJc w:val=\"left\"/></w:lvl>"
-           "</w:abstractNum>"
-           "<w:num w:numId=\"1\"><w:abstractNumId w:val=\"0\"/></w:num>"
+           LIST_ABSTRACT_NUM("0")
+           LIST_NUM("1", "0")
            "</w:numbering>";
 }
 
+#define DOCUMENT_HEADER \
+    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n" \
+    "<w:document xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" " \
+    "xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" " \
+    "xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\" " \
+    "xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\" " \
+    "xmlns:pic=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">" \
+    "<w:body>"
+#define DOCUMENT_FOOTER "</w:body></w:document>"
+
 /* Create the main document.xml with content */
 static char *get_document_xml(docx_context *ctx)
 {
     size_t capacity = ctx->xml_size + 1024;
-    char *xml = malloc(capacity);
+    char *xml = dt_malloc(ctx->dt, capacity);
     if (!xml) return NULL;
     
-    const char *header = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
-                        "<w:document xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\" "
-                        "xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" "
-                        "xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\" "
-                        "xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\" "
-                        "xmlns:pic=\"http://schemas.openxmlformats.org/drawingml/2006/picture\">"
-                        "<w:body>";
-    const char *footer = "</w:body></w:document>";
+    const char *header = DOCUMENT_HEADER;
+    const reference_doc *ref = ctx->dt->ref;
+    const char *sectpr = ref && ref->sectpr ? ref->sectpr : "";
+    const char *footer = DOCUMENT_FOOTER;
     
     size_t header_len = strlen(header);
+    size_t sectpr_len = strlen(sectpr);
     size_t footer_len = strlen(footer);
-    size_t total = header_len + ctx->xml_size + footer_len + 1;
+    size_t total = header_len + ctx->xml_size + sectpr_len + footer_len + 1;
     
     if (total > capacity) {
         capacity = total;
-        char *new_xml = realloc(xml, capacity);
+        char *new_xml = dt_realloc(ctx->dt, xml, capacity);
         if (!new_xml) {
-            free(xml);
+            dt_free(ctx->dt, xml);
             return NULL;
         }
         xml = new_xml;
@@ -772,181 +860,1868 @@ static char *get_document_xml(docx_context *ctx)
     
     strcpy(xml, header);
     memcpy(xml + header_len, ctx->xml_buffer, ctx->xml_size);
-    strcpy(xml + header_len + ctx->xml_size, footer);
+    memcpy(xml + header_len + ctx->xml_size, sectpr, sectpr_len);
+    strcpy(xml + header_len + ctx->xml_size + sectpr_len, footer);
     
     return xml;
 }
 
-/* Add file to ZIP archive */
-static int add_file_to_zip(mz_zip_archive *zip, const char *archive_name, const void *data, size_t size)
+/* Earliest time a zip entry can be dated, 1980-01-01 UTC */
+#define DOS_EPOCH 315532800LL
+
+/* The time the parts of dt's documents are dated, in *t, or NULL for the
+ * time of conversion. miniz writes local time, so it is set to the local
+ * time that reads as dt->mtime does in UTC, which gives the same DOS date
+ * in every time zone */
+static MZ_TIME_T *part_mtime(const doctxt_ctx *dt, MZ_TIME_T *t)
+{
+    time_t utc = (time_t)MAX(dt->mtime, DOS_EPOCH);
+    struct tm tm;
+    
+    if (!dt->mtime || !gmtime_r(&utc, &tm)) {
+        return NULL;
+    }
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    return t;
+}
+
+/* Add file to ZIP archive, dated mtime or, when NULL, now */
+static int add_file_to_zip(mz_zip_archive *zip, const char *archive_name, const void *data, size_t size,
+                           MZ_TIME_T *mtime)
 {
-    return mz_zip_writer_add_mem(zip, archive_name, data, size, MZ_DEFAULT_COMPRESSION);
+    return mz_zip_writer_add_mem_ex_v2(zip, archive_name, data, size, NULL, 0, MZ_DEFAULT_COMPRESSION,
+                                       0, 0, mtime, NULL, 0, NULL, 0);
 }
 
-/* Convert markdown to DOCX */
-static int convert_markdown_to_docx(const char *md_file, const char *docx_file)
+/* Add the image at path, dated mtime or, when NULL, as the file is */
+static int add_image_to_zip(mz_zip_archive *zip, const char *archive_name, const char *path,
+                            MZ_TIME_T *mtime)
 {
-    size_t md_size;
-    char *md_content = read_file(md_file, &md_size);
-    if (!md_content) {
-        fprintf(stderr, "Error: Cannot read input file '%s'\n", md_file);
-        return 1;
+    struct stat st;
+    FILE *fp;
+    int ok;
+    
+    if (!mtime) {
+        return mz_zip_writer_add_file(zip, archive_name, path, NULL, 0, MZ_DEFAULT_COMPRESSION);
     }
+    if (!(fp = fopen(path, "rb"))) {
+        return 0;
+    }
+    ok = fstat(fileno(fp), &st) == 0 &&
+         mz_zip_writer_add_cfile(zip, archive_name, fp, st.st_size, mtime, NULL, 0,
+                                 MZ_DEFAULT_COMPRESSION, NULL, 0, NULL, 0);
+    fclose(fp);
+    return ok;
+}
+
+/* Parts that are the same in every document, deflated once per process */
+enum { PART_CONTENT_TYPES, PART_RELS, PART_STYLES, PART_NUMBERING, NUM_STATIC_PARTS };
+
+static static_part static_parts[NUM_STATIC_PARTS];
+static unsigned char static_parts_buf[8192];
+static pthread_once_t static_parts_once = PTHREAD_ONCE_INIT;
+
+/* Deflate xml into buf of bufsize bytes for part name; returns the
+ * compressed size, 0 if it did not fit */
+static size_t compress_part(static_part *part, const char *name, const char *xml,
+                            unsigned char *buf, size_t bufsize)
+{
+    int flags = tdefl_create_comp_flags_from_zip_params(MZ_DEFAULT_LEVEL, -15, MZ_DEFAULT_STRATEGY);
     
-    // Initialize context
-    docx_context ctx = {0};
-    ctx.xml_capacity = 64 * 1024;
-    ctx.xml_buffer = malloc(ctx.xml_capacity);
-    if (!ctx.xml_buffer) {
-        free(md_content);
-        die("Out of memory");
+    part->name = name;
+    part->xml = xml;
+    part->size = strlen(xml);
+    part->crc = (mz_uint32)mz_crc32(MZ_CRC32_INIT, (const unsigned char *)xml, part->size);
+    part->comp = buf;
+    part->comp_size = tdefl_compress_mem_to_mem(buf, bufsize, xml, part->size, flags);
+    return part->comp_size;
+}
+
+static void init_static_parts(void)
+{
+    static const char *const names[NUM_STATIC_PARTS] = {
+        "[Content_Types].xml", "_rels/.rels", "word/styles.xml", "word/numbering.xml"
+    };
+    const char *xml[NUM_STATIC_PARTS];
+    size_t used = 0;
+    
+    xml[PART_CONTENT_TYPES] = get_content_types_xml();
+    xml[PART_RELS] = get_rels_xml();
+    xml[PART_STYLES] = get_styles_xml();
+    xml[PART_NUMBERING] = get_numbering_xml();
+    for (int i = 0; i < NUM_STATIC_PARTS; i++) {
+        used += compress_part(&static_parts[i], names[i], xml[i], static_parts_buf + used,
+                              sizeof(static_parts_buf) - used);
     }
-    ctx.xml_size = 0;
-    ctx.next_image_id = 1;
+}
+
+static int add_static_part(mz_zip_archive *zip, const static_part *part, MZ_TIME_T *mtime)
+{
+    if (part->comp_size == 0) {
+        return add_file_to_zip(zip, part->name, part->xml, part->size, mtime);
+    }
+    return mz_zip_writer_add_mem_ex_v2(zip, part->name, part->comp, part->comp_size, NULL, 0,
+                                       MZ_DEFAULT_LEVEL | MZ_ZIP_FLAG_COMPRESSED_DATA,
+                                       part->size, part->crc, mtime, NULL, 0, NULL, 0);
+}
+
+/* Relationship types of the template that are kept. Its body is not, so
+ * neither are the images, links, comments and the like it refers to */
+static const char *const reference_rel_types[] = {
+    "styles", "stylesWithEffects", "settings", "webSettings", "fontTable", "theme",
+    "header", "footer", "footnotes", "endnotes", NULL
+};
+
+static void free_reference_doc(doctxt_ctx *dt, void *p)
+{
+    reference_doc *ref = p;
     
-    // Set up MD4C parser with GitHub-flavored markdown
-    MD_PARSER parser = {0};
-    parser.abi_version = 0;
-    parser.flags = MD_FLAG_TABLES | MD_FLAG_STRIKETHROUGH | MD_FLAG_TASKLISTS | 
-                   MD_FLAG_PERMISSIVEAUTOLINKS | MD_FLAG_UNDERLINE;
-    parser.enter_block = enter_block_callback;
-    parser.leave_block = leave_block_callback;
-    parser.enter_span = enter_span_callback;
-    parser.leave_span = leave_span_callback;
-    parser.text = text_callback;
+    mz_zip_reader_end(&ref->zip);
+    dt_free(dt, ref->data);
+    dt_free(dt, ref->parts);
+    dt_free(dt, ref->rels);
+    dt_free(dt, ref->sectpr);
+    dt_free(dt, ref->types_xml);
+    dt_free(dt, ref->types_comp);
+    dt_free(dt, ref->numbering_xml);
+    dt_free(dt, ref->numbering_comp);
+    dt_free(dt, ref);
+}
+
+/* w:numId of the list items in dt's documents */
+static int list_num_id(const doctxt_ctx *dt)
+{
+    const reference_doc *ref = dt->ref;
+    return ref ? ref->list_id : 1;
+}
+
+/* Resolve a relationship target against the folder of its source part,
+ * base ending in '/' or empty, into a part name */
+static int resolve_target(const char *base, const char *target, char *out, size_t size)
+{
+    size_t len = 0;
     
-    // Parse markdown
-    int ret = md_parse(md_content, md_size, &parser, &ctx);
-    free(md_content);
+    if (*target == '/') {
+        target++;
+    } else {
+        len = strlen(base);
+        if (len >= size) return 0;
+        memcpy(out, base, len);
+    }
+    for (;;) {
+        if (strncmp(target, "./", 2) == 0) {
+            target += 2;
+        } else if (strncmp(target, "../", 3) == 0) {
+            target += 3;
+            if (len > 0) len--;
+            while (len > 0 && out[len - 1] != '/') len--;
+        } else {
+            break;
+        }
+    }
+    if (len + strlen(target) >= size) return 0;
+    strcpy(out + len, target);
+    return 1;
+}
+
+/* Copy part name of the template into documents, unless it is missing, one
+ * of those written for every document or already copied */
+static int add_reference_part(doctxt_ctx *dt, reference_doc *ref, const char *name)
+{
+    static const char *const own[] = {
+        "[Content_Types].xml", "_rels/.rels", "word/document.xml",
+        "word/_rels/document.xml.rels", "word/numbering.xml", NULL
+    };
+    int i = mz_zip_reader_locate_file(&ref->zip, name, NULL, 0);
     
-    if (ret != 0) {
-        fprintf(stderr, "Error: Failed to parse markdown (code %d)\n", ret);
-        free(ctx.xml_buffer);
-        free_image_paths(&ctx);
-        return 1;
+    if (i < 0) return 1;
+    for (int j = 0; own[j]; j++) {
+        if (mz_zip_reader_locate_file(&ref->zip, own[j], NULL, 0) == i) return 1;
+    }
+    for (int j = 0; j < ref->nparts; j++) {
+        if (ref->parts[j] == i) return 1;
+    }
+    if (ref->nparts == ref->parts_capacity) {
+        int capacity = ref->parts_capacity ? ref->parts_capacity * 2 : 16;
+        int *parts = dt_realloc(dt, ref->parts, capacity * sizeof(*parts));
+        if (!parts) return 0;
+        ref->parts = parts;
+        ref->parts_capacity = capacity;
     }
+    ref->parts[ref->nparts++] = i;
+    return 1;
+}
+
+static const char *attr_value(struct txml_node *node, const char *name)
+{
+    struct txml_node *attr = txml_find(node, NULL, TXML_ATTRIBUTE, name, NULL, 0);
+    return attr ? attr->value : NULL;
+}
+
+/* Parse the relationships part name of the template, base being the folder
+ * of its source part. Targets of the kinds in types (all when NULL) are
+ * copied; for the document's own relationships, the kept ones are also
+ * rewritten into out with their ids prefixed by 't' */
+static int load_reference_rels(doctxt_ctx *dt, reference_doc *ref, const char *name,
+                               const char *base, const char *const *types, docx_context *out)
+{
+    size_t size;
+    char *xml = dt_zip_part(dt, &ref->zip, name, &size);
+    struct txml_node *nodes, *root, *rel = NULL;
     
-    // Null-terminate XML buffer
-    if (ctx.xml_size >= ctx.xml_capacity) {
-        char *new_buffer = realloc(ctx.xml_buffer, ctx.xml_size + 1);
-        if (!new_buffer) {
-            free(ctx.xml_buffer);
-            free_image_paths(&ctx);
-            die("Out of memory");
+    if (!xml) {
+        return dt->err;
+    }
+    if (!(nodes = dt_parse_xml(dt, xml, size)) ||
+        !(root = txml_find(nodes, NULL, TXML_ELEMENT, "Relationships", NULL, 0))) {
+        return dt_error(dt, DOCTXT_EXML, "Malformed %s in reference document", name);
+    }
+    while ((rel = txml_find(root, rel, TXML_ELEMENT, "Relationship", NULL, 0)) && !dt->err) {
+        const char *id = attr_value(rel, "Id");
+        const char *type = attr_value(rel, "Type");
+        const char *target = attr_value(rel, "Target");
+        const char *mode = attr_value(rel, "TargetMode");
+        const char *kind = type ? strrchr(type, '/') : NULL;
+        char part[512];
+        int keep = !types;
+        
+        if (!id || !kind || !target) continue;
+        for (int i = 0; types && types[i]; i++) {
+            keep |= strcmp(kind + 1, types[i]) == 0;
+        }
+        if (!keep) continue;
+        if (!(mode && strcmp(mode, "External") == 0)) {
+            if (!resolve_target(base, target, part, sizeof(part)) ||
+                mz_zip_reader_locate_file(&ref->zip, part, NULL, 0) < 0) {
+                continue;
+            }
+            if (!add_reference_part(dt, ref, part)) break;
+            ref->styles |= out && strcmp(kind + 1, "styles") == 0;
+        }
+        if (out) {
+            append_xml(out, "<Relationship Id=\"t");
+            append_xml(out, id);
+            append_xml(out, "\" Type=\"");
+            append_xml(out, type);
+            append_xml(out, "\" Target=\"");
+            append_xml(out, target);
+            if (mode) {
+                append_xml(out, "\" TargetMode=\"");
+                append_xml(out, mode);
+            }
+            append_xml(out, "\"/>");
         }
-        ctx.xml_buffer = new_buffer;
     }
-    ctx.xml_buffer[ctx.xml_size] = '\0';
+    return dt->err;
+}
+
+/* Start of the first element named tag (e.g. "<w:num") in xml, or NULL */
+static const char *find_element(const char *xml, const char *tag)
+{
+    size_t len = strlen(tag);
     
-    // Create DOCX (ZIP archive)
-    mz_zip_archive zip = {0};
-    if (!mz_zip_writer_init_file(&zip, docx_file, 0)) {
-        fprintf(stderr, "Error: Cannot create output file '%s'\n", docx_file);
-        free(ctx.xml_buffer);
-        free_image_paths(&ctx);
-        return 1;
+    for (const char *p = xml; (p = strstr(p, tag)); p += len) {
+        if (p[len] == ' ' || p[len] == '>' || p[len] == '/') return p;
     }
+    return NULL;
+}
+
+/* Largest value of attribute name (e.g. " w:numId=\"") in xml, or -1 */
+static int max_attr(const char *xml, const char *name)
+{
+    int max = -1;
     
-    // Add required files to ZIP
-    const char *content_types = get_content_types_xml();
-    add_file_to_zip(&zip, "[Content_Types].xml", content_types, strlen(content_types));
+    for (const char *p = xml; (p = strstr(p, name)); p++) {
+        max = MAX(max, atoi(p + strlen(name)));
+    }
+    return max;
+}
+
+/* Merge our list into the template's numbering.xml, whose definitions its
+ * styles refer to: the template keeps its IDs and ours follow them. The
+ * schema wants every w:abstractNum before the first w:num */
+static int load_reference_numbering(doctxt_ctx *dt, reference_doc *ref)
+{
+    docx_context numbering;
+    const char *rels = "word/_rels/numbering.xml.rels";
+    const char *nums, *end;
+    char list[512];
+    size_t size;
+    char *xml;
     
-    const char *rels = get_rels_xml();
-    add_file_to_zip(&zip, "_rels/.rels", rels, strlen(rels));
+    ref->list_id = 1;
+    if (mz_zip_reader_locate_file(&ref->zip, "word/numbering.xml", NULL, 0) < 0) {
+        return DOCTXT_OK;
+    }
+    if (!(xml = dt_zip_part(dt, &ref->zip, "word/numbering.xml", &size))) {
+        return dt->err;
+    }
+    if (!(end = strstr(xml, "</w:numbering>"))) {
+        return DOCTXT_OK;
+    }
+    if (!(nums = find_element(xml, "<w:num")) || nums > end) {
+        const char *cleanup = find_element(xml, "<w:numIdMacAtCleanup");
+        nums = cleanup && cleanup < end ? cleanup : end;
+    }
+    int abstract_id = max_attr(xml, " w:abstractNumId=\"") + 1;
+    ref->list_id = MAX(max_attr(xml, " w:numId=\"") + 1, 1);
     
-    char *doc_rels = get_document_rels_xml(&ctx);
-    if (doc_rels) {
-        add_file_to_zip(&zip, "word/_rels/document.xml.rels", doc_rels, strlen(doc_rels));
-        free(doc_rels);
+    if (!init_docx_context(&numbering, dt, 0)) return dt->err;
+    append_xml_n(&numbering, xml, nums - xml);
+    snprintf(list, sizeof(list), LIST_ABSTRACT_NUM("%d"), abstract_id);
+    append_xml(&numbering, list);
+    const char *cleanup = find_element(nums, "<w:numIdMacAtCleanup");
+    const char *tail = cleanup && cleanup < end ? cleanup : end;
+    append_xml_n(&numbering, nums, tail - nums);
+    snprintf(list, sizeof(list), LIST_NUM("%d", "%d"), ref->list_id, abstract_id);
+    append_xml(&numbering, list);
+    append_xml(&numbering, tail);
+    numbering.xml_buffer[numbering.xml_size] = '\0';
+    ref->numbering_xml = numbering.xml_buffer;
+    if (dt->err) return dt->err;
+    if (!(ref->numbering_comp = dt_malloc(dt, numbering.xml_size))) {
+        return dt->err;
     }
+    compress_part(&ref->numbering, "word/numbering.xml", ref->numbering_xml,
+                  ref->numbering_comp, numbering.xml_size);
     
-    char *document = get_document_xml(&ctx);
-    if (document) {
-        add_file_to_zip(&zip, "word/document.xml", document, strlen(document));
-        free(document);
+    /* Picture bullets bring their images */
+    if (mz_zip_reader_locate_file(&ref->zip, rels, NULL, 0) >= 0 && add_reference_part(dt, ref, rels)) {
+        load_reference_rels(dt, ref, rels, "word/", NULL, NULL);
     }
+    return dt->err;
+}
+
+/* Gather what documents take from the template: the parts reachable from
+ * the kept relationships, with their content types, its numbering and
+ * the section properties at the end of its body */
+static int load_reference(doctxt_ctx *dt, reference_doc *ref)
+{
+    docx_context rels, types, sectpr;
+    struct txml_node *nodes, *root, *node = NULL;
+    size_t size;
+    char *xml;
     
-    const char *styles = get_styles_xml();
-    add_file_to_zip(&zip, "word/styles.xml", styles, strlen(styles));
+    if (mz_zip_reader_locate_file(&ref->zip, "word/document.xml", NULL, 0) < 0 ||
+        mz_zip_reader_locate_file(&ref->zip, "word/_rels/document.xml.rels", NULL, 0) < 0 ||
+        mz_zip_reader_locate_file(&ref->zip, "[Content_Types].xml", NULL, 0) < 0) {
+        return dt_error(dt, DOCTXT_ENOPART, "Reference document is not a Word document");
+    }
+    if (!init_docx_context(&rels, dt, 0)) return dt->err;
+    load_reference_rels(dt, ref, "word/_rels/document.xml.rels", "word/",
+                        reference_rel_types, &rels);
+    rels.xml_buffer[rels.xml_size] = '\0';
+    ref->rels = rels.xml_buffer;
+    if (dt->err || load_reference_numbering(dt, ref) != DOCTXT_OK) return dt->err;
     
-    const char *numbering = get_numbering_xml();
-    add_file_to_zip(&zip, "word/numbering.xml", numbering, strlen(numbering));
+    /* The kept parts bring what they refer to themselves, such as the
+     * images in headers */
+    for (int i = 0; i < ref->nparts && !dt->err; i++) {
+        char name[512], part_rels[512];
+        mz_zip_reader_get_filename(&ref->zip, ref->parts[i], name, sizeof(name));
+        const char *file = strrchr(name, '/');
+        int dirlen = file ? (int)(file + 1 - name) : 0;
+        
+        if (strlen(name) > 5 && strcmp(name + strlen(name) - 5, ".rels") == 0) continue;
+        snprintf(part_rels, sizeof(part_rels), "%.*s_rels/%s.rels", dirlen, name, name + dirlen);
+        if (mz_zip_reader_locate_file(&ref->zip, part_rels, NULL, 0) < 0) continue;
+        if (!add_reference_part(dt, ref, part_rels)) break;
+        name[dirlen] = '\0';
+        load_reference_rels(dt, ref, part_rels, name, NULL, NULL);
+    }
+    if (dt->err) return dt->err;
     
-    // Add images if any
-    for (int i = 0; i < ctx.image_count; i++) {
-        size_t img_size;
-        char *img_data = read_file(ctx.image_paths[i], &img_size);
-        if (img_data) {
-            char archive_name[256];
-            const char *ext = strrchr(ctx.image_paths[i], '.');
-            if (!ext) ext = ".png";
-            snprintf(archive_name, sizeof(archive_name), "word/media/image%d%s", i + 1, ext);
-            add_file_to_zip(&zip, archive_name, img_data, img_size);
-            free(img_data);
+    /* Content types: ours, then the template's other defaults and the
+     * overrides of the copied parts */
+    if (!(xml = dt_zip_part(dt, &ref->zip, "[Content_Types].xml", &size))) {
+        return dt->err;
+    }
+    if (!(nodes = dt_parse_xml(dt, xml, size)) ||
+        !(root = txml_find(nodes, NULL, TXML_ELEMENT, "Types", NULL, 0))) {
+        return dt_error(dt, DOCTXT_EXML, "Malformed [Content_Types].xml in reference document");
+    }
+    if (!init_docx_context(&types, dt, 0)) return dt->err;
+    append_xml(&types, CONTENT_TYPES_HEADER);
+    while ((node = txml_find(root, node, TXML_ELEMENT, "Default", NULL, 0))) {
+        const char *ext = attr_value(node, "Extension");
+        const char *type = attr_value(node, "ContentType");
+        if (!ext || !type || !strcmp(ext, "rels") || !strcmp(ext, "xml") ||
+            !strcmp(ext, "png") || !strcmp(ext, "jpg") || !strcmp(ext, "jpeg")) {
+            continue;
+        }
+        append_xml(&types, "<Default Extension=\"");
+        append_xml(&types, ext);
+        append_xml(&types, "\" ContentType=\"");
+        append_xml(&types, type);
+        append_xml(&types, "\"/>");
+    }
+    append_xml(&types, CONTENT_TYPE_DOCUMENT);
+    if (!ref->styles) {
+        append_xml(&types, CONTENT_TYPE_STYLES);
+    }
+    append_xml(&types, CONTENT_TYPE_NUMBERING);
+    while ((node = txml_find(root, node, TXML_ELEMENT, "Override", NULL, 0))) {
+        const char *name = attr_value(node, "PartName");
+        const char *type = attr_value(node, "ContentType");
+        int i = name && *name == '/' ? mz_zip_reader_locate_file(&ref->zip, name + 1, NULL, 0) : -1;
+        int copied = 0;
+        for (int j = 0; j < ref->nparts && i >= 0; j++) {
+            copied |= ref->parts[j] == i;
         }
+        if (!copied || !type) continue;
+        append_xml(&types, "<Override PartName=\"");
+        append_xml(&types, name);
+        append_xml(&types, "\" ContentType=\"");
+        append_xml(&types, type);
+        append_xml(&types, "\"/>");
     }
+    append_xml(&types, "</Types>");
+    types.xml_buffer[types.xml_size] = '\0';
+    ref->types_xml = types.xml_buffer;
+    if (dt->err) return dt->err;
+    if (!(ref->types_comp = dt_malloc(dt, types.xml_size))) {
+        return dt->err;
+    }
+    compress_part(&ref->types, "[Content_Types].xml", ref->types_xml,
+                  ref->types_comp, types.xml_size);
     
-    // Finalize ZIP
-    if (!mz_zip_writer_finalize_archive(&zip)) {
-        fprintf(stderr, "Error: Failed to finalize ZIP archive\n");
-        mz_zip_writer_end(&zip);
-        free(ctx.xml_buffer);
-        free_image_paths(&ctx);
-        return 1;
+    /* The last sectPr is the one of the body, with the header and footer
+     * references; its ids follow those of the kept relationships */
+    if (!(xml = dt_zip_part(dt, &ref->zip, "word/document.xml", &size))) {
+        return dt->err;
+    }
+    const char *p = NULL, *end;
+    for (const char *q = xml; (q = strstr(q, "<w:sectPr")); q++) {
+        if (q[9] == ' ' || q[9] == '>' || q[9] == '/') p = q;
+    }
+    if (!p || !(end = strchr(p, '>'))) return DOCTXT_OK;
+    if (end[-1] != '/') {
+        if (!(end = strstr(end, "</w:sectPr>"))) return DOCTXT_OK;
+        end += strlen("</w:sectPr>") - 1;
+    }
+    if (!init_docx_context(&sectpr, dt, 0)) return dt->err;
+    for (const char *q; (q = strstr(p, " r:id=\"")) && q < end; p = q + 7) {
+        append_xml_n(&sectpr, p, q + 7 - p);
+        append_xml(&sectpr, "t");
     }
+    append_xml_n(&sectpr, p, end + 1 - p);
+    sectpr.xml_buffer[sectpr.xml_size] = '\0';
+    ref->sectpr = sectpr.xml_buffer;
+    return dt->err;
+}
+
+/* Keep the deflated XML of converted sections in dir, see convert_cached() */
+int doctxt_set_cache_dir(doctxt_ctx *dt, const char *dir)
+{
+    char *copy = NULL;
     
-    mz_zip_writer_end(&zip);
-    free(ctx.xml_buffer);
-    free_image_paths(&ctx);
+    dt_begin(dt);
+    if (dir && !(copy = dt_malloc(dt, strlen(dir) + 1))) {
+        return dt->err;
+    }
+    if (copy) {
+        strcpy(copy, dir);
+    }
+    dt_free(dt, dt->cache_dir);
+    dt->cache_dir = copy;
+    return DOCTXT_OK;
+}
+
+/* Read images for the documents converted on dt from now on only from
+ * below dir */
+int doctxt_set_image_dir(doctxt_ctx *dt, const char *dir)
+{
+    char *copy = NULL;
+    char real[PATH_MAX];
     
-    printf("Successfully converted '%s' to '%s'\n", md_file, docx_file);
-    return 0;
+    dt_begin(dt);
+    if (dir && *dir && !realpath(dir, real)) {
+        return dt_error(dt, DOCTXT_EIO, "Cannot open image directory '%s'", dir);
+    }
+    if (dir && *dir) {
+        dir = real;
+    }
+    if (dir && !(copy = dt_malloc(dt, strlen(dir) + 1))) {
+        return dt->err;
+    }
+    if (copy) {
+        strcpy(copy, dir);
+    }
+    dt_free(dt, dt->image_dir);
+    dt->image_dir = copy;
+    return DOCTXT_OK;
 }
 
-static void usage(void)
+/* Date the parts of the documents converted on dt from now on mtime */
+int doctxt_set_mtime(doctxt_ctx *dt, long long mtime)
 {
-    fprintf(stderr, "usage: md2docx input.md [-o output.docx]\n");
-    fprintf(stderr, "\nOptions:\n");
-    fprintf(stderr, "  -o FILE    Specify output file (default: output.docx)\n");
-    fprintf(stderr, "  -v         Display version information\n");
-    fprintf(stderr, "  -h         Display this help message\n");
-    exit(1);
+    dt_begin(dt);
+    dt->mtime = mtime;
+    return DOCTXT_OK;
 }
 
-int main(int argc, char *argv[])
+/* Use the template docx for the documents converted on dt from now on */
+int doctxt_set_reference_doc(doctxt_ctx *dt, const void *docx, size_t size)
 {
-    char *input_file = NULL;
-    char *output_file = "output.docx";
+    reference_doc *ref;
     
-    // Parse arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-v") == 0) {
-            printf("md2docx version %s\n", VERSION_STR);
-            return 0;
-        } else if (strcmp(argv[i], "-h") == 0) {
-            usage();
-        } else if (strcmp(argv[i], "-o") == 0) {
-            if (i + 1 >= argc) {
-                fprintf(stderr, "Error: -o requires an argument\n");
-                usage();
-            }
-            output_file = argv[++i];
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
-            usage();
-        } else {
-            if (input_file) {
-                fprintf(stderr, "Error: Multiple input files specified\n");
-                usage();
-            }
-            input_file = argv[i];
+    dt_begin(dt);
+    if (dt->ref_free) {
+        dt->ref_free(dt, dt->ref);
+        dt->ref = NULL;
+        dt->ref_free = NULL;
+    }
+    if (!docx) {
+        return DOCTXT_OK;
+    }
+    if (!(ref = dt_malloc(dt, sizeof(*ref)))) {
+        return dt->err;
+    }
+    memset(ref, 0, sizeof(*ref));
+    if (!(ref->data = dt_malloc(dt, size ? size : 1))) {
+        free_reference_doc(dt, ref);
+        return dt->err;
+    }
+    memcpy(ref->data, docx, size);
+    DT_ZIP_ALLOC(&ref->zip, dt);
+    if (!mz_zip_reader_init_mem(&ref->zip, ref->data, size, 0)) {
+        free_reference_doc(dt, ref);
+        return dt_error(dt, DOCTXT_EZIP, "Reference document is not a readable zip archive");
+    }
+    if (load_reference(dt, ref) != DOCTXT_OK) {
+        free_reference_doc(dt, ref);
+        return dt->err;
+    }
+    dt->ref = ref;
+    dt->ref_free = free_reference_doc;
+    return DOCTXT_OK;
+}
+
+/* miniz write callback collecting the archive in the context's output */
+static size_t write_to_output(void *opaque, mz_uint64 file_ofs, const void *buf, size_t n)
+{
+    doctxt_ctx *dt = opaque;
+    
+    /* miniz seeks back to patch local headers, so allow overwrites */
+    if (file_ofs > dt->outlen) return 0;
+    size_t overlap = MIN(n, dt->outlen - (size_t)file_ofs);
+    if (overlap > 0) memcpy(dt->out + file_ofs, buf, overlap);
+    if (overlap < n && !out_write(dt, (const char *)buf + overlap, n - overlap)) {
+        return 0;
+    }
+    return n;
+}
+
+static void free_md_parser(void *md)
+{
+    md_parse_ctx_free(md);
+}
+
+/* Set up an empty context writing to dt, numbering its images from
+ * image_base */
+static int init_docx_context(docx_context *ctx, doctxt_ctx *dt, int image_base)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->dt = dt;
+    ctx->xml_capacity = 64 * 1024;
+    ctx->xml_buffer = dt_malloc(dt, ctx->xml_capacity);
+    ctx->image_base = image_base;
+    ctx->next_image_id = image_base + 1;
+    return ctx->xml_buffer != NULL;
+}
+
+/* Set up the context of a whole document, on the XML buffer the previous
+ * document on dt left behind */
+static int init_document_context(docx_context *ctx, doctxt_ctx *dt)
+{
+    if (!dt->xml) {
+        return init_docx_context(ctx, dt, 0);
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->dt = dt;
+    ctx->xml_buffer = dt->xml;
+    ctx->xml_capacity = dt->xmlcap;
+    ctx->next_image_id = 1;
+    dt->xml = NULL;
+    return 1;
+}
+
+/* Leave the XML buffer of ctx to the next document on its dt */
+static void keep_xml_buffer(docx_context *ctx)
+{
+    dt_free(ctx->dt, ctx->dt->xml);
+    ctx->dt->xml = ctx->xml_buffer;
+    ctx->dt->xmlcap = ctx->xml_capacity;
+}
+
+/* Parser context of dt, created on first use. It and its buffers stay with
+ * the library context, so a warm context converts without allocating
+ * inside md4c */
+static MD_PARSE_CTX *md_parser(doctxt_ctx *dt)
+{
+    if (!dt->md) {
+        if (!(dt->md = md_parse_ctx_new())) {
+            dt_error(dt, DOCTXT_ENOMEM, "Out of memory");
+            return NULL;
         }
+        dt->md_free = free_md_parser;
     }
+    return dt->md;
+}
+
+/* Parse markdown into ctx. Reference definitions gathered from the rest
+ * of the document come first in defs; they produce no output */
+static int parse_markdown(docx_context *ctx, const char *defs, size_t defslen,
+                          const char *md, size_t size)
+{
+    doctxt_ctx *dt = ctx->dt;
+    MD_PARSE_CTX *mdp;
+    char *text = NULL;
     
-    if (!input_file) {
-        fprintf(stderr, "Error: No input file specified\n");
-        usage();
+    // Set up MD4C parser with GitHub-flavored markdown
+    MD_PARSER parser = {0};
+    parser.abi_version = 0;
+    parser.flags = MD_FLAGS;
+    parser.enter_block = enter_block_callback;
+    parser.leave_block = leave_block_callback;
+    parser.enter_span = enter_span_callback;
+    parser.leave_span = leave_span_callback;
+    parser.text = text_callback;
+    
+    if (!(mdp = md_parser(dt))) {
+        return dt->err;
+    }
+    if (defslen > 0) {
+        if (!(text = dt_malloc(dt, defslen + size))) {
+            return dt->err;
+        }
+        memcpy(text, defs, defslen);
+        memcpy(text + defslen, md, size);
+        md = text;
+        size += defslen;
+    }
+    int ret = md_parse_ex(mdp, md, size, &parser, ctx);
+    if (text) {
+        dt_free(dt, text);
     }
     
-    return convert_markdown_to_docx(input_file, output_file);
+    if (ret != 0 || dt->err) {
+        /* a callback abort keeps the error that caused it */
+        return dt_error(dt, DOCTXT_EMARKDOWN, "Failed to parse markdown (code %d)", ret);
+    }
+    return DOCTXT_OK;
+}
+
+/* Where to cut the markdown, as md4c's block scan finds it */
+typedef struct {
+    doctxt_ctx *dt;
+    const char *md;
+    size_t size;
+    size_t last_rdef;   // Offset of the last "]:", where a definition may end
+    size_t nchunks;     // 0: cut before every heading
+    size_t n;
+    size_t *cuts;
+    size_t cuts_capacity;
+    char *defs;
+    size_t defslen;
+    size_t defscap;
+    int fail;           // A definition md4c found inside a container
+} split_state;
+
+static int split_cut(MD_OFFSET off, void *userdata)
+{
+    split_state *s = userdata;
+    const char *p = s->md + off, *end = s->md + s->size;
+    
+    if (s->fail) {
+        return 1;
+    }
+    if (s->nchunks && s->n == s->nchunks && off > s->last_rdef) {
+        return 1;   // no definitions past this point
+    }
+    
+    /* An HTML block leaves its paragraph open for the next HTML or quote
+     * block, also across definitions, and a blank line here is the start
+     * of the next chunk's first paragraph; cutting before any of them
+     * would change the output */
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end || *p == '\n' || *p == '\r' || *p == '<' || *p == '>' || *p == '[') {
+        return 0;
+    }
+    if (s->nchunks ? s->n < s->nchunks && off >= s->size * s->n / s->nchunks : *p == '#') {
+        if (s->n == s->cuts_capacity) {
+            size_t capacity = s->cuts_capacity * 2;
+            size_t *cuts = arena_grow(s->dt, s->cuts, s->cuts_capacity * sizeof(*cuts),
+                                      capacity * sizeof(*cuts));
+            if (!cuts) {
+                s->fail = 1;
+                return 1;
+            }
+            s->cuts = cuts;
+            s->cuts_capacity = capacity;
+        }
+        s->cuts[s->n++] = off;
+    }
+    return 0;
+}
+
+static void split_ref_defs(MD_OFFSET beg, MD_OFFSET end, int nested, void *userdata)
+{
+    split_state *s = userdata;
+    size_t len = end - beg;
+    
+    if (nested || s->fail) {
+        s->fail = 1;
+        return;
+    }
+    if (s->defslen + len + 2 > s->defscap) {
+        size_t newcap = MAX(s->defscap * 2, s->defslen + len + 2 + 256);
+        if (!(s->defs = arena_grow(s->dt, s->defs, s->defscap, newcap))) {
+            s->fail = 1;
+            return;
+        }
+        s->defscap = newcap;
+    }
+    memcpy(s->defs + s->defslen, s->md + beg, len);
+    s->defs[s->defslen + len] = '\n';
+    s->defslen += len + 1;
+}
+
+/* Choose where to cut md for up to nchunks threads, near equal sizes, or
+ * with nchunks 0 into sections, each starting at a heading. The offsets
+ * go to *cuts. Reference definitions are gathered into *defs, so that
+ * every chunk can resolve links to all of them. Returns the number of
+ * chunks, 1 when the document has to be converted in one piece */
+static size_t split_markdown(doctxt_ctx *dt, const char *md, size_t size, size_t nchunks,
+                             size_t **cuts, char **defs, size_t *defslen)
+{
+    static const MD_SCANNER scanner = { split_cut, split_ref_defs };
+    MD_PARSER parser = {0};
+    MD_PARSE_CTX *mdp;
+    split_state s = {0};
+    
+    *defs = NULL;
+    *defslen = 0;
+    s.cuts_capacity = nchunks ? nchunks : 64;
+    if (!(*cuts = s.cuts = arena_alloc(dt, s.cuts_capacity * sizeof(*s.cuts)))) {
+        return 1;
+    }
+    s.cuts[0] = 0;
+    if (!(mdp = md_parser(dt))) {
+        return 1;
+    }
+    parser.flags = MD_FLAGS;
+    s.dt = dt;
+    s.md = md;
+    s.size = size;
+    for (size_t i = size; i > 1; i--) {
+        if (md[i - 2] == ']' && md[i - 1] == ':') {
+            s.last_rdef = i - 2;
+            break;
+        }
+    }
+    s.nchunks = nchunks;
+    s.n = 1;
+    
+    if (md_scan(mdp, md, size, &parser, &scanner, &s) < 0 || s.fail) {
+        return 1;
+    }
+    *cuts = s.cuts;
+    /* a blank line ends the definitions' paragraph */
+    if (s.defslen > 0) {
+        s.defs[s.defslen++] = '\n';
+    }
+    *defs = s.defs;
+    *defslen = s.defslen;
+    return s.n;
+}
+
+/* Upper bound on the images in md, as each one starts with "![" */
+static int count_images(const char *md, size_t size)
+{
+    const char *p = md, *end = md + size;
+    int n = 0;
+    
+    while ((p = memchr(p, '!', end - p)) && end - p > 1) {
+        n += (p[1] == '[');
+        p++;
+    }
+    return n;
+}
+
+/* Contiguous run of top-level blocks converted on its own thread, into
+ * its own library context */
+typedef struct {
+    docx_context ctx;
+    doctxt_ctx *dt;
+    const char *defs;
+    size_t defslen;
+    const char *md;
+    size_t size;
+    int image_base;
+    const char *image_dir;
+    pthread_t thread;
+    int running;
+} md_chunk;
+
+static void *chunk_worker(void *arg)
+{
+    md_chunk *c = arg;
+    parse_markdown(&c->ctx, c->defs, c->defslen, c->md, c->size);
+    return NULL;
+}
+
+/* Start a chunk on its own context, which uses the default allocator
+ * since the caller's is only promised to be used from one thread. A
+ * chunk that does not start runs on the caller's thread instead */
+static void start_chunk(md_chunk *c)
+{
+    if (!(c->dt = doctxt_new(NULL))) {
+        return;
+    }
+    if (c->image_dir && doctxt_set_image_dir(c->dt, c->image_dir) != DOCTXT_OK) {
+        return;
+    }
+    dt_begin(c->dt);
+    if (!init_docx_context(&c->ctx, c->dt, c->image_base)) {
+        return;
+    }
+    if (pthread_create(&c->thread, NULL, chunk_worker, c) != 0) {
+        return;
+    }
+    c->running = 1;
+}
+
+/* Leave image indices before base unused */
+static void skip_images(docx_context *ctx, int base)
+{
+    while (ctx->image_count < base && !ctx->dt->err) {
+        add_image(ctx, NULL, 0);
+    }
+    ctx->next_image_id = ctx->image_count + 1;
+}
+
+/* Fragment cache: the part of document.xml a run of sections turns into
+ * lives in the cache directory under a hash of everything it is generated
+ * from, deflated on its own, so unchanged runs are neither converted nor
+ * compressed again. A fragment holds the image paths the sections add,
+ * the size and CRC-32 of their XML and the deflate blocks. Files are
+ * written under a temporary name and renamed, so concurrent runs can
+ * share a directory */
+#define FRAGMENT_MAGIC "md2docx fragment 1\n"
+#define FRAGMENT_MIN (16 * 1024)    /* Markdown bytes per fragment, so that */
+#define FRAGMENT_MAX (256 * 1024)   /* deflate has some context to work with */
+
+typedef struct {
+    mz_ulong crc;
+    unsigned long long fnv;
+} fragment_key;
+
+static void hash_update(fragment_key *key, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    
+    if (!len) return;   // defs may be NULL
+    key->crc = mz_crc32(key->crc, p, len);
+    for (size_t i = 0; i < len; i++) {
+        key->fnv = (key->fnv ^ p[i]) * 0x100000001b3ULL;
+    }
+}
+
+/* Whether a fragment of len bytes ends with the section at sec. Besides
+ * the size, only the section's heading decides, so an edit moves no
+ * boundary but the ones next to it */
+static int fragment_ends(const char *sec, const char *end, size_t len)
+{
+    unsigned h = 2166136261u;
+    
+    if (len >= FRAGMENT_MAX) return 1;
+    if (len < FRAGMENT_MIN) return 0;
+    for (; sec < end && *sec != '\n'; sec++) {
+        h = (h ^ (unsigned char)*sec) * 16777619u;
+    }
+    return h % 4 == 0;
+}
+
+/* Path of the fragment for sections md, which render differently only
+ * in another version, with other flags, definitions, list ID or, when
+ * they have images, image base */
+static void fragment_path(char *path, size_t size, const doctxt_ctx *dt, const char *defs,
+                          size_t defslen, const char *md, size_t mdlen, int base)
+{
+    fragment_key key = { MZ_CRC32_INIT, 0xcbf29ce484222325ULL };
+    char buf[128];
+    int n;
+    
+    n = snprintf(buf, sizeof(buf), "%s%s %u %d %d %zu ", FRAGMENT_MAGIC, VERSION_STR,
+                 (unsigned)MD_FLAGS, list_num_id(dt), count_images(md, mdlen) ? base : 0, defslen);
+    hash_update(&key, buf, n);
+    if (dt->image_dir) {
+        hash_update(&key, dt->image_dir, strlen(dt->image_dir) + 1);
+    }
+    hash_update(&key, defs, defslen);
+    hash_update(&key, md, mdlen);
+    snprintf(path, size, "%s/%08lx%016llx.frag", dt->cache_dir, (unsigned long)key.crc, key.fnv);
+}
+
+/* Make room for len more deflated bytes */
+static int reserve_deflated(docx_context *ctx, size_t len)
+{
+    deflated_xml *d = ctx->deflated;
+    
+    if (d->size + len > d->capacity) {
+        size_t capacity = MAX(d->capacity * 2, d->size + len);
+        unsigned char *data = arena_grow(ctx->dt, d->data, d->capacity, capacity);
+        if (!data) return 0;
+        d->data = data;
+        d->capacity = capacity;
+    }
+    return 1;
+}
+
+static mz_bool put_deflated(const void *buf, int len, void *user)
+{
+    docx_context *ctx = user;
+    deflated_xml *d = ctx->deflated;
+    
+    if (!reserve_deflated(ctx, len)) return MZ_FALSE;
+    memcpy(d->data + d->size, buf, len);
+    d->size += len;
+    return MZ_TRUE;
+}
+
+/* Deflate len bytes of xml as the next piece, ended with flush; returns
+ * their CRC-32 */
+static mz_ulong deflate_xml(docx_context *ctx, const char *xml, size_t len, tdefl_flush flush)
+{
+    deflated_xml *d = ctx->deflated;
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)xml, len);
+    
+    if (tdefl_compress_buffer(d->comp, xml, len, flush) < 0 && !ctx->dt->err) {
+        dt_error(ctx->dt, DOCTXT_ENOMEM, "Out of memory");
+    }
+    d->crc = mz_crc32_combine(d->crc, crc, len);
+    d->xml_size += len;
+    return crc;
+}
+
+/* Splice the fragment at path into ctx; 0 when it is missing or damaged */
+static int load_fragment(docx_context *ctx, const char *path)
+{
+    deflated_xml *d = ctx->deflated;
+    size_t len, magic = sizeof(FRAGMENT_MAGIC) - 1, xml_size;
+    const char *data, *paths, *p, *end, *nl;
+    char *q;
+    unsigned long crc;
+    int nimages, i, mapped;
+    
+    if (!(data = mapfile(path, &len, &mapped))) {
+        return 0;
+    }
+    end = data + len;
+    if (len <= magic || memcmp(data, FRAGMENT_MAGIC, magic) != 0 ||
+        !(nl = memchr(data + magic, '\n', end - data - magic))) {
+        unmapfile(data, len, mapped);
+        return 0;
+    }
+    nimages = atoi(data + magic);
+    paths = p = nl + 1;
+    for (i = 0; i < nimages && (nl = memchr(p, '\n', end - p)); i++) {
+        p = nl + 1;
+    }
+    if (i < nimages || !(nl = memchr(p, '\n', end - p)) || nl + 1 == end) {
+        unmapfile(data, len, mapped);
+        return 0;
+    }
+    xml_size = strtoul(p, &q, 10);
+    crc = strtoul(q, NULL, 16);
+    p = nl + 1;
+    
+    if (reserve_deflated(ctx, end - p)) {
+        memcpy(d->data + d->size, p, end - p);
+        d->size += end - p;
+        d->crc = mz_crc32_combine(d->crc, crc, xml_size);
+        d->xml_size += xml_size;
+    }
+    for (p = paths; nimages-- > 0 && !ctx->dt->err; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        add_image(ctx, p, nl - p);
+    }
+    unmapfile(data, len, mapped);
+    return 1;
+}
+
+/* Open a temporary file next to path, named in tmp_path */
+static FILE *create_cache_file(const char *path, char *tmp_path, size_t size)
+{
+    FILE *fp;
+    int fd;
+    
+    snprintf(tmp_path, size, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp_path)) < 0) {
+        return NULL;
+    }
+    if (!(fp = fdopen(fd, "wb"))) {
+        close(fd);
+        remove(tmp_path);
+    }
+    return fp;
+}
+
+/* Close fp and move it from tmp_path to path, if all went well; returns
+ * whether it did */
+static int commit_cache_file(FILE *fp, const char *tmp_path, const char *path)
+{
+    int ok = !ferror(fp);
+    
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    /* mkstemp creates 0600 files, the cache is meant to be shared */
+    if (!ok || chmod(tmp_path, 0644) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Write the fragment of part, deflated into comp_size bytes at comp, to
+ * path; a cache that cannot be written only costs the next run the
+ * conversion */
+static void store_fragment(const docx_context *part, const unsigned char *comp,
+                           size_t comp_size, mz_ulong crc, const char *path)
+{
+    char tmp_path[PATH_MAX + 8];
+    FILE *fp;
+    
+    for (int i = 0; i < part->image_count; i++) {
+        if (strchr(part->image_paths[i], '\n')) {
+            return;
+        }
+    }
+    if (!(fp = create_cache_file(path, tmp_path, sizeof(tmp_path)))) {
+        return;
+    }
+    fprintf(fp, "%s%d\n", FRAGMENT_MAGIC, part->image_count);
+    for (int i = 0; i < part->image_count; i++) {
+        fprintf(fp, "%s\n", part->image_paths[i]);
+    }
+    fprintf(fp, "%zu %08lx\n", part->xml_size, (unsigned long)crc);
+    fwrite(comp, 1, comp_size, fp);
+    commit_cache_file(fp, tmp_path, path);
+}
+
+/* Convert md in runs of sections, each cut at a heading, into a deflated
+ * document.xml, taking unchanged runs from the cache directory. They are
+ * converted with all reference definitions, so they render as in one
+ * piece. Every piece ends in a full flush, which leaves nothing for the
+ * next one to refer back to, so cached pieces fit anywhere */
+static void convert_cached(docx_context *ctx, const char *md, size_t size)
+{
+    doctxt_ctx *dt = ctx->dt;
+    const reference_doc *ref = dt->ref;
+    const char *sectpr = ref && ref->sectpr ? ref->sectpr : "";
+    char path[PATH_MAX];
+    deflated_xml *d;
+    size_t *cuts, n, none = 0;
+    char *defs;
+    size_t defslen;
+    
+    if (!(d = arena_alloc(dt, sizeof(*d)))) {
+        return;
+    }
+    memset(d, 0, sizeof(*d));
+    if (!(d->comp = arena_alloc(dt, sizeof(*d->comp)))) {
+        return;
+    }
+    ctx->deflated = d;
+    tdefl_init(d->comp, put_deflated, ctx,
+               tdefl_create_comp_flags_from_zip_params(MZ_DEFAULT_LEVEL, -15, MZ_DEFAULT_STRATEGY));
+    deflate_xml(ctx, DOCUMENT_HEADER, strlen(DOCUMENT_HEADER), TDEFL_FULL_FLUSH);
+    
+    n = split_markdown(dt, md, size, 0, &cuts, &defs, &defslen);
+    if (n < 2) {
+        cuts = &none;
+    }
+    for (size_t i = 0, j; i < n && !dt->err; i = j) {
+        const char *sec = md + cuts[i];
+        size_t len;
+        int base = ctx->image_count;
+        docx_context part;
+        
+        /* sections i to j - 1 */
+        for (j = i + 1; j < n; j++) {
+            if (fragment_ends(md + cuts[j - 1], md + size, cuts[j] - cuts[i])) break;
+        }
+        len = (j < n ? md + cuts[j] : md + size) - sec;
+        fragment_path(path, sizeof(path), dt, defs, defslen, sec, len, base);
+        if (load_fragment(ctx, path)) {
+            continue;
+        }
+        if (!init_docx_context(&part, dt, base)) {
+            return;
+        }
+        if (parse_markdown(&part, defs, defslen, sec, len) == DOCTXT_OK) {
+            size_t start = d->size;
+            mz_ulong crc = deflate_xml(ctx, part.xml_buffer, part.xml_size, TDEFL_FULL_FLUSH);
+            if (!dt->err) {
+                store_fragment(&part, d->data + start, d->size - start, crc, path);
+            }
+            for (int j = 0; j < part.image_count && !dt->err; j++) {
+                add_image(ctx, part.image_paths[j], strlen(part.image_paths[j]));
+            }
+        }
+        dt_free(dt, part.xml_buffer);
+    }
+    
+    deflate_xml(ctx, sectpr, strlen(sectpr), TDEFL_NO_FLUSH);
+    deflate_xml(ctx, DOCUMENT_FOOTER, strlen(DOCUMENT_FOOTER), TDEFL_FINISH);
+}
+
+/* Convert markdown into ctx. Large documents are cut between top-level
+ * blocks and the pieces converted on separate threads; block state does
+ * not outlive a top-level block, so their XML only needs to be
+ * concatenated in order. Each chunk numbers its images from the count of
+ * images possible in the chunks before it */
+static void convert_markdown(docx_context *ctx, const char *md, size_t size)
+{
+    size_t nchunks = MIN(MIN((size_t)dt_threads(ctx->dt), MAX_CHUNKS), size / CHUNK_MIN);
+    size_t *cuts;
+    md_chunk *chunks = NULL;
+    char *defs = NULL;
+    size_t defslen = 0;
+    
+    if (ctx->dt->cache_dir) {
+        convert_cached(ctx, md, size);
+        return;
+    }
+    if (nchunks >= 2) {
+        nchunks = split_markdown(ctx->dt, md, size, nchunks, &cuts, &defs, &defslen);
+    }
+    if (nchunks < 2 || !(chunks = arena_alloc(ctx->dt, nchunks * sizeof(*chunks)))) {
+        parse_markdown(ctx, NULL, 0, md, size);
+        return;
+    }
+    
+    memset(chunks, 0, nchunks * sizeof(*chunks));
+    int base = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        md_chunk *c = &chunks[i];
+        c->defs = defs;
+        c->defslen = defslen;
+        c->md = md + cuts[i];
+        c->size = (i + 1 < nchunks ? cuts[i + 1] : size) - cuts[i];
+        c->image_base = base;
+        c->image_dir = ctx->dt->image_dir;
+        base += count_images(c->md, c->size);
+    }
+    for (size_t i = 1; i < nchunks; i++) {
+        start_chunk(&chunks[i]);
+    }
+    
+    /* The first chunk runs here, straight into the caller's context */
+    parse_markdown(ctx, defs, defslen, chunks[0].md, chunks[0].size);
+    for (size_t i = 1; i < nchunks; i++) {
+        md_chunk *c = &chunks[i];
+        if (!c->running) {
+            skip_images(ctx, c->image_base);
+            if (!ctx->dt->err) {
+                parse_markdown(ctx, defs, defslen, c->md, c->size);
+            }
+            continue;
+        }
+        pthread_join(c->thread, NULL);
+        if (c->dt->err) {
+            dt_error(ctx->dt, c->dt->err, "%s", doctxt_errmsg(c->dt));
+        } else if (!ctx->dt->err) {
+            append_xml_n(ctx, c->ctx.xml_buffer, c->ctx.xml_size);
+            skip_images(ctx, c->image_base);
+            for (int j = 0; j < c->ctx.image_count && !ctx->dt->err; j++) {
+                add_image(ctx, c->ctx.image_paths[j], strlen(c->ctx.image_paths[j]));
+            }
+        }
+    }
+    for (size_t i = 1; i < nchunks; i++) {
+        if (chunks[i].ctx.xml_buffer) {
+            dt_free(chunks[i].dt, chunks[i].ctx.xml_buffer);
+        }
+        doctxt_free(chunks[i].dt);
+    }
+}
+
+/* Convert markdown to DOCX in dt's result, leaving the images the
+ * document names in ctx */
+static int md_to_docx(doctxt_ctx *dt, docx_context *ctx, const char *md_content, size_t md_size,
+                      const void **out, size_t *outsize)
+{
+    MZ_TIME_T mtime_buf, *mtime = part_mtime(dt, &mtime_buf);
+    
+    dt_begin(dt);
+    *out = NULL;
+    *outsize = 0;
+    
+    // Initialize context
+    if (!init_document_context(ctx, dt)) {
+        return dt->err;
+    }
+    
+    // Parse markdown
+    convert_markdown(ctx, md_content, md_size);
+    if (dt->err) {
+        keep_xml_buffer(ctx);
+        return dt->err;
+    }
+    
+    // Null-terminate XML buffer (reserve_xml always leaves room for it)
+    ctx->xml_buffer[ctx->xml_size] = '\0';
+    
+    // Create DOCX (ZIP archive) in the context's output buffer
+    mz_zip_archive zip = {0};
+    DT_ZIP_ALLOC(&zip, dt);
+    zip.m_pWrite = write_to_output;
+    zip.m_pIO_opaque = dt;
+    if (!mz_zip_writer_init_v2(&zip, 0, 0)) {
+        keep_xml_buffer(ctx);
+        dt->outlen = 0;
+        return dt_error(dt, DOCTXT_ENOMEM, "Cannot create ZIP archive");
+    }
+    
+    // Add required files to ZIP
+    const reference_doc *ref = dt->ref;
+    pthread_once(&static_parts_once, init_static_parts);
+    add_static_part(&zip, ref ? &ref->types : &static_parts[PART_CONTENT_TYPES], mtime);
+    add_static_part(&zip, &static_parts[PART_RELS], mtime);
+    
+    char *doc_rels = get_document_rels_xml(ctx);
+    if (doc_rels) {
+        add_file_to_zip(&zip, "word/_rels/document.xml.rels", doc_rels, strlen(doc_rels), mtime);
+        dt_free(dt, doc_rels);
+    }
+    
+    if (ctx->deflated) {
+        const deflated_xml *d = ctx->deflated;
+        static_part part = { "word/document.xml", NULL, d->xml_size, (mz_uint32)d->crc,
+                             d->data, d->size };
+        add_static_part(&zip, &part, mtime);
+    } else {
+        char *document = get_document_xml(ctx);
+        if (document) {
+            add_file_to_zip(&zip, "word/document.xml", document, strlen(document), mtime);
+            dt_free(dt, document);
+        }
+    }
+    
+    if (!ref || !ref->styles) {
+        add_static_part(&zip, &static_parts[PART_STYLES], mtime);
+    }
+    add_static_part(&zip, ref && ref->numbering_xml ? &ref->numbering : &static_parts[PART_NUMBERING],
+                    mtime);
+    
+    // Parts of the reference document go in still compressed
+    for (int i = 0; ref && i < ref->nparts; i++) {
+        mz_zip_writer_add_from_zip_reader(&zip, (mz_zip_archive *)&ref->zip, ref->parts[i]);
+    }
+    
+    // Add images if any; unreadable images are left out
+    for (int i = 0; i < ctx->image_count; i++) {
+        char archive_name[256];
+        if (!ctx->image_paths[i]) continue;
+        const char *ext = strrchr(ctx->image_paths[i], '.');
+        if (!ext) ext = ".png";
+        snprintf(archive_name, sizeof(archive_name), "word/media/%s%d%s", MEDIA_NAME(ctx), i + 1, ext);
+        add_image_to_zip(&zip, archive_name, ctx->image_paths[i], mtime);
+    }
+    
+    // Finalize ZIP
+    if (!mz_zip_writer_finalize_archive(&zip) && !dt->err) {
+        dt_error(dt, DOCTXT_ENOMEM, "Failed to finalize ZIP archive");
+    }
+    
+    mz_zip_writer_end(&zip);
+    keep_xml_buffer(ctx);
+    
+    const char *result;
+    int err = dt_end(dt, &result, outsize);
+    *out = result;
+    return err;
+}
+
+/* Convert markdown to DOCX */
+int doctxt_md_to_docx(doctxt_ctx *dt, const char *md, size_t size,
+                      const void **out, size_t *outsize)
+{
+    docx_context ctx;
+    
+    return md_to_docx(dt, &ctx, md, size, out, outsize);
+}
+
+/* Output cache: a finished document is kept in the cache directory as
+ * <key>.docx, key hashing the markdown and everything else but images it
+ * is made of. Which images it holds is only known after conversion, so
+ * <key>.deps lists them with the size and CRC-32 they had, after the size
+ * and CRC-32 of the document itself:
+ *
+ *   md2docx output 1
+ *   <size> <crc>
+ *   <size> <crc> <path>    or    - - <path>    for an unreadable image
+ *
+ * The document is written first, so a .deps file never names a document
+ * older than itself */
+#define OUTPUT_MAGIC "md2docx output 1\n"
+
+/* Path of the cached document for md on dt, without extension */
+static void output_path(char *path, size_t size, const doctxt_ctx *dt, const char *md, size_t mdlen)
+{
+    const reference_doc *ref = dt->ref;
+    size_t reflen = ref ? (size_t)ref->zip.m_archive_size : 0;
+    fragment_key key = { MZ_CRC32_INIT, 0xcbf29ce484222325ULL };
+    char buf[128];
+    int n;
+    
+    n = snprintf(buf, sizeof(buf), "%s%s %u %lld %zu %zu ", OUTPUT_MAGIC, VERSION_STR,
+                 (unsigned)MD_FLAGS, dt->mtime, reflen, mdlen);
+    hash_update(&key, buf, n);
+    if (dt->image_dir) {
+        hash_update(&key, dt->image_dir, strlen(dt->image_dir) + 1);
+    }
+    if (ref) {
+        hash_update(&key, ref->data, reflen);
+    }
+    hash_update(&key, md, mdlen);
+    snprintf(path, size, "%s/%08lx%016llx", dt->cache_dir, (unsigned long)key.crc, key.fnv);
+}
+
+/* Size and CRC-32 of the file at path; 0 when it cannot be read */
+static int file_crc(const char *path, size_t *size, unsigned long *crc)
+{
+    const char *data;
+    int mapped;
+    
+    if (!(data = mapfile(path, size, &mapped))) {
+        return 0;
+    }
+    *crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)data, *size);
+    unmapfile(data, *size, mapped);
+    return 1;
+}
+
+/* Whether the image at path still has the "<size> <crc>" line starts
+ * with, "- -" when it could not be read */
+static int image_unchanged(const char *line, const char *path)
+{
+    unsigned long crc;
+    size_t size;
+    char *q;
+    
+    if (!file_crc(path, &size, &crc)) {
+        return strncmp(line, "- - ", 4) == 0;
+    }
+    return line[0] != '-' && strtoull(line, &q, 10) == size && strtoul(q, NULL, 16) == crc;
+}
+
+/* The document cached at path if it and its images are unchanged, mapped
+ * into *len bytes as by mapfile(); NULL otherwise */
+static const char *cached_output(const char *path, size_t *len, int *mapped)
+{
+    char file[PATH_MAX + 8], *deps, *p, *nl, *q;
+    size_t deps_len, magic = sizeof(OUTPUT_MAGIC) - 1;
+    const char *docx;
+    
+    snprintf(file, sizeof(file), "%s.deps", path);
+    if (!(deps = readfile(file, &deps_len))) {
+        return NULL;
+    }
+    if (deps_len <= magic || memcmp(deps, OUTPUT_MAGIC, magic) != 0 || deps[deps_len - 1] != '\n') {
+        free(deps);
+        return NULL;
+    }
+    /* The document's line comes first, then one per image */
+    for (p = strchr(deps + magic, '\n') + 1; *p; p = nl + 1) {
+        nl = strchr(p, '\n');
+        *nl = '\0';
+        if (!(q = strchr(p, ' ')) || !(q = strchr(q + 1, ' ')) || !image_unchanged(p, q + 1)) {
+            break;
+        }
+    }
+    snprintf(file, sizeof(file), "%s.docx", path);
+    docx = *p ? NULL : mapfile(file, len, mapped);
+    if (docx && (strtoull(deps + magic, &q, 10) != *len ||
+                 strtoul(q, NULL, 16) != mz_crc32(MZ_CRC32_INIT, (const unsigned char *)docx, *len))) {
+        unmapfile(docx, *len, *mapped);
+        docx = NULL;
+    }
+    free(deps);
+    return docx;
+}
+
+/* Keep docx, len bytes converted in ctx, as the document at path;
+ * returns whether path.docx now holds it */
+static int store_output(const docx_context *ctx, const void *docx, size_t len, const char *path)
+{
+    char file[PATH_MAX + 8], tmp_path[PATH_MAX + 16];
+    unsigned long crc;
+    size_t size;
+    FILE *fp;
+    
+    for (int i = 0; i < ctx->image_count; i++) {
+        if (ctx->image_paths[i] && strchr(ctx->image_paths[i], '\n')) {
+            return 0;
+        }
+    }
+    snprintf(file, sizeof(file), "%s.docx", path);
+    if (!(fp = create_cache_file(file, tmp_path, sizeof(tmp_path)))) {
+        return 0;
+    }
+    fwrite(docx, 1, len, fp);
+    if (!commit_cache_file(fp, tmp_path, file)) {
+        return 0;
+    }
+    
+    snprintf(file, sizeof(file), "%s.deps", path);
+    if (!(fp = create_cache_file(file, tmp_path, sizeof(tmp_path)))) {
+        return 1;
+    }
+    fprintf(fp, "%s%zu %08lx\n", OUTPUT_MAGIC, len,
+            (unsigned long)mz_crc32(MZ_CRC32_INIT, docx, len));
+    for (int i = 0; i < ctx->image_count; i++) {
+        if (!ctx->image_paths[i]) {
+            continue;
+        }
+        if (file_crc(ctx->image_paths[i], &size, &crc)) {
+            fprintf(fp, "%zu %08lx %s\n", size, crc, ctx->image_paths[i]);
+        } else {
+            fprintf(fp, "- - %s\n", ctx->image_paths[i]);
+        }
+    }
+    commit_cache_file(fp, tmp_path, file);
+    return 1;
+}
+
+/* Put docx, len bytes, into the file out: as a hard link to the cached
+ * copy at file, if not NULL, where the file system allows, which leaves
+ * nothing to write, a copy otherwise. Links are touched, so that make(1)
+ * sees them as new. A file with other links is replaced rather than
+ * written over, since it may be in the cache */
+static int put_output(const char *file, const void *docx, size_t len, const char *out)
+{
+    char tmp_path[PATH_MAX + 32];
+    struct stat st, cached;
+    int linked = 0;
+    
+    if (strcmp(out, "-") == 0) {
+        return writefile(out, docx, len);
+    }
+    if (file && stat(file, &cached) == 0) {
+        if (stat(out, &st) == 0 && st.st_dev == cached.st_dev && st.st_ino == cached.st_ino) {
+            linked = 1;
+        } else if (lstat(out, &st) != 0) {
+            linked = link(file, out) == 0;
+        } else if (S_ISREG(st.st_mode)) {
+            /* Replace out in one step, so it is never missing */
+            snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", out, (long)getpid());
+            linked = link(file, tmp_path) == 0 && rename(tmp_path, out) == 0;
+            if (!linked) {
+                remove(tmp_path);
+            }
+        }
+        if (linked) {
+            utimensat(AT_FDCWD, out, NULL, 0);
+            return 1;
+        }
+    }
+    if (lstat(out, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        remove(out);
+    }
+    return writefile(out, docx, len);
+}
+
+/* Convert markdown into the DOCX file at path, taking it from the cache
+ * when it holds the document */
+int doctxt_md_to_docx_file(doctxt_ctx *dt, const char *md, size_t size, const char *path)
+{
+    char cached[PATH_MAX], file[PATH_MAX + 8];
+    const char *stored = NULL;
+    docx_context ctx;
+    const void *docx;
+    size_t docx_size;
+    int ok;
+    
+    if (dt->cache_dir) {
+        const char *data;
+        size_t len;
+        int mapped;
+        
+        output_path(cached, sizeof(cached), dt, md, size);
+        snprintf(file, sizeof(file), "%s.docx", cached);
+        if ((data = cached_output(cached, &len, &mapped))) {
+            dt_begin(dt);
+            ok = put_output(file, data, len, path);
+            unmapfile(data, len, mapped);
+            return ok ? DOCTXT_OK : dt_error(dt, DOCTXT_EIO, "Cannot write output file '%s'", path);
+        }
+    }
+    if (md_to_docx(dt, &ctx, md, size, &docx, &docx_size) != DOCTXT_OK) {
+        return dt->err;
+    }
+    if (dt->cache_dir && store_output(&ctx, docx, docx_size, cached)) {
+        stored = file;
+    }
+    if (!put_output(stored, docx, docx_size, path)) {
+        return dt_error(dt, DOCTXT_EIO, "Cannot write output file '%s'", path);
+    }
+    return DOCTXT_OK;
+}
+
+#ifndef DOCTXT_LIB
+/* Convert md_file into docx_file on ctx; failures are reported on stderr */
+static int convert_file(doctxt_ctx *ctx, const char *md_file, const char *docx_file)
+{
+    size_t md_size;
+    char *md_content = readfile(md_file, &md_size);
+    if (!md_content) {
+        fprintf(stderr, "Error: Cannot read input file '%s'\n", md_file);
+        return 1;
+    }
+    
+    /* The archive is complete in memory, so a pipe gets it as is */
+    if (doctxt_md_to_docx_file(ctx, md_content, md_size, docx_file) != DOCTXT_OK) {
+        fprintf(stderr, "Error: %s: %s\n", md_file, doctxt_errmsg(ctx));
+        free(md_content);
+        return 1;
+    }
+    free(md_content);
+    return 0;
+}
+
+/* A library context with the reference document, cache and fixed part
+ * dates, if any */
+static doctxt_ctx *new_context(const char *ref, size_t ref_size, const char *ref_file,
+                               const char *cache_dir, long long mtime)
+{
+    doctxt_ctx *ctx = doctxt_new(NULL);
+    if (!ctx) die("Out of memory");
+    
+    if (ref && doctxt_set_reference_doc(ctx, ref, ref_size) != DOCTXT_OK) {
+        fprintf(stderr, "Error: %s: %s\n", ref_file, doctxt_errmsg(ctx));
+        doctxt_free(ctx);
+        return NULL;
+    }
+    if (cache_dir && doctxt_set_cache_dir(ctx, cache_dir) != DOCTXT_OK) die("Out of memory");
+    doctxt_set_mtime(ctx, mtime);
+    return ctx;
+}
+
+/* Files shared out to the batch workers, each of which converts on a
+ * context of its own, so parsers, buffers and the reference document are
+ * set up once per worker rather than once per file */
+typedef struct {
+    char **inputs;
+    char **outputs;         // outdir/name.docx for each input
+    int ninputs;
+    int next;               // First input not taken yet
+    int failed;
+    pthread_mutex_t lock;
+} batch;
+
+typedef struct {
+    batch *b;
+    doctxt_ctx *ctx;
+    pthread_t thread;
+} batch_worker;
+
+static void *batch_work(void *arg)
+{
+    batch_worker *w = arg;
+    batch *b = w->b;
+    
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->ninputs) {
+            break;
+        }
+        if (convert_file(w->ctx, b->inputs[i], b->outputs[i]) != 0) {
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    return NULL;
+}
+
+/* outdir/name.docx, for input some/dir/name.md */
+static char *batch_output(const char *outdir, const char *input)
+{
+    const char *name = strrchr(input, '/');
+    name = name ? name + 1 : input;
+    const char *ext = strrchr(name, '.');
+    int len = ext && ext != name ? (int)(ext - name) : (int)strlen(name);
+    char *docx_file = xmalloc(strlen(outdir) + len + sizeof("/.docx"));
+    sprintf(docx_file, "%s/%.*s.docx", outdir, len, name);
+    return docx_file;
+}
+
+static int compare_outputs(const void *a, const void *b)
+{
+    return strcmp(**(char ***)a, **(char ***)b);
+}
+
+/* Whether two inputs would be written to the same file, which would
+ * leave only one of them, or a mix of both; reported on stderr */
+static int duplicate_outputs(char **inputs, char **outputs, int n)
+{
+    char ***sorted = ecalloc(n, sizeof(*sorted));
+    int dup = 0;
+    
+    for (int i = 0; i < n; i++) {
+        sorted[i] = &outputs[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), compare_outputs);
+    for (int i = 1; i < n; i++) {
+        if (strcmp(*sorted[i - 1], *sorted[i]) == 0) {
+            fprintf(stderr, "Error: '%s' and '%s' would both be written to '%s'\n",
+                    inputs[sorted[i - 1] - outputs], inputs[sorted[i] - outputs], *sorted[i]);
+            dup = 1;
+        }
+    }
+    free(sorted);
+    return dup;
+}
+
+static void free_outputs(char **outputs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        free(outputs[i]);
+    }
+    free(outputs);
+}
+
+/* Convert inputs into outdir on nthreads threads, the calling one included */
+static int convert_batch(char **inputs, int ninputs, const char *outdir, int nthreads,
+                         const char *ref, size_t ref_size, const char *ref_file,
+                         const char *cache_dir, long long mtime)
+{
+    batch b = { inputs, NULL, ninputs, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    
+    b.outputs = ecalloc(MAX(ninputs, 1), sizeof(*b.outputs));
+    for (int i = 0; i < ninputs; i++) {
+        b.outputs[i] = batch_output(outdir, inputs[i]);
+    }
+    if (duplicate_outputs(inputs, b.outputs, ninputs)) {
+        free_outputs(b.outputs, ninputs);
+        return 1;
+    }
+    
+    nthreads = MAX(MIN(nthreads, ninputs), 1);
+    batch_worker *workers = ecalloc(nthreads, sizeof(*workers));
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].b = &b;
+        if (!(workers[i].ctx = new_context(ref, ref_size, ref_file, cache_dir, mtime))) {
+            while (i-- > 0) {
+                doctxt_free(workers[i].ctx);
+            }
+            free(workers);
+            free_outputs(b.outputs, ninputs);
+            return 1;
+        }
+        /* The workers share the CPUs for splitting large documents */
+        workers[i].ctx->threads = MAX(dt_threads(NULL) / nthreads, 1);
+    }
+    
+    /* A worker that cannot be started leaves its share to the others */
+    int started = 1;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[started].thread, NULL, batch_work, &workers[started]) == 0) {
+            started++;
+        }
+    }
+    batch_work(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    for (int i = 0; i < nthreads; i++) {
+        doctxt_free(workers[i].ctx);
+    }
+    free(workers);
+    free_outputs(b.outputs, ninputs);
+    if (b.failed) {
+        fprintf(stderr, "%d of %d files failed\n", b.failed, ninputs);
+    }
+    return b.failed != 0;
+}
+
+/* Input paths from stdin, one per line */
+static char **read_inputs(int *ninputs)
+{
+    char **inputs = NULL, *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int n = 0, cap = 0;
+    
+    while ((len = getline(&line, &linecap, stdin)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (!len) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if (!(inputs = realloc(inputs, cap * sizeof(*inputs)))) die("Out of memory");
+        }
+        inputs[n] = xmalloc(len + 1);
+        memcpy(inputs[n++], line, len + 1);
+    }
+    free(line);
+    *ninputs = n;
+    return inputs;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: md2docx input.md [-o output.docx] [--reference-doc template.docx]\n");
+    fprintf(stderr, "               [--cache dir] [--reproducible]\n");
+    fprintf(stderr, "       md2docx -d dir [-j threads] [--reference-doc template.docx]\n");
+    fprintf(stderr, "               [--cache dir] [--reproducible] [input.md ...]\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -o FILE    Specify output file, - for stdout (default: output.docx)\n");
+    fprintf(stderr, "  -d DIR     Convert any number of files into DIR/name.docx\n");
+    fprintf(stderr, "  -j N       Convert on N threads with -d (default: one per CPU)\n");
+    fprintf(stderr, "  --reference-doc FILE\n");
+    fprintf(stderr, "             Take styles, headers, footers and page setup from FILE\n");
+    fprintf(stderr, "  --cache DIR\n");
+    fprintf(stderr, "             Keep converted sections and documents in DIR and reuse\n");
+    fprintf(stderr, "             unchanged ones\n");
+    fprintf(stderr, "  --reproducible\n");
+    fprintf(stderr, "             Date every part $SOURCE_DATE_EPOCH, or 1980-01-01, so\n");
+    fprintf(stderr, "             that the same input gives the same bytes\n");
+    fprintf(stderr, "  -v         Display version information\n");
+    fprintf(stderr, "  -h         Display this help message\n");
+    fprintf(stderr, "\nAn input of - reads markdown from stdin. With -d and no inputs,\n");
+    fprintf(stderr, "the input paths are read from stdin, one per line\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char **inputs = ecalloc(argc, sizeof(*inputs));
+    int ninputs = 0;
+    char *output_file = NULL;
+    char *outdir = NULL;
+    char *ref_file = NULL;
+    char *cache_dir = NULL;
+    int nthreads = 0;
+    long long mtime = 0;
+    
+    // Parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            printf("md2docx version %s\n", VERSION_STR);
+            return 0;
+        } else if (strcmp(argv[i], "-h") == 0) {
+            usage();
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -o requires an argument\n");
+                usage();
+            }
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -d requires an argument\n");
+                usage();
+            }
+            outdir = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc || (nthreads = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "Error: -j requires a positive number\n");
+                usage();
+            }
+            i++;
+        } else if (strcmp(argv[i], "--reference-doc") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --reference-doc requires an argument\n");
+                usage();
+            }
+            ref_file = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --cache requires an argument\n");
+                usage();
+            }
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--reproducible") == 0) {
+            const char *epoch = getenv("SOURCE_DATE_EPOCH");
+            mtime = epoch ? atoll(epoch) : 0;
+            if (mtime <= 0) {
+                mtime = 315532800;  // 1980-01-01, the first DOS date
+            }
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            usage();
+        } else {
+            inputs[ninputs++] = argv[i];
+        }
+    }
+    
+    if (outdir && output_file) {
+        fprintf(stderr, "Error: -o and -d cannot be combined\n");
+        usage();
+    }
+    if (!outdir && nthreads) {
+        fprintf(stderr, "Error: -j needs -d\n");
+        usage();
+    }
+    if (!outdir && ninputs != 1) {
+        fprintf(stderr, ninputs ? "Error: Multiple input files need -d\n"
+                                : "Error: No input file specified\n");
+        usage();
+    }
+    
+    /* The template is read once, whatever the number of files */
+    size_t ref_size = 0;
+    char *ref = NULL;
+    if (ref_file && !(ref = readfile(ref_file, &ref_size))) {
+        fprintf(stderr, "Error: Cannot read reference document '%s'\n", ref_file);
+        return 1;
+    }
+    
+    if (cache_dir && mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create cache directory '%s': %s\n", cache_dir, strerror(errno));
+        return 1;
+    }
+    
+    int ret;
+    if (outdir) {
+        int from_stdin = ninputs == 0;
+        if (from_stdin) {
+            free(inputs);
+            inputs = read_inputs(&ninputs);
+        }
+        if (!nthreads) {
+            nthreads = (int)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+        }
+        ret = convert_batch(inputs, ninputs, outdir, nthreads, ref, ref_size, ref_file,
+                            cache_dir, mtime);
+        for (int i = 0; from_stdin && i < ninputs; i++) {
+            free(inputs[i]);
+        }
+    } else {
+        doctxt_ctx *ctx = new_context(ref, ref_size, ref_file, cache_dir, mtime);
+        if (!output_file) {
+            output_file = "output.docx";
+        }
+        ret = !ctx || convert_file(ctx, inputs[0], output_file);
+        if (ret == 0 && strcmp(output_file, "-") != 0) {
+            printf("Successfully converted '%s' to '%s'\n", inputs[0], output_file);
+        }
+        doctxt_free(ctx);
+    }
+    free(inputs);
+    free(ref);
+    return ret;
 }
+#endif /* DOCTXT_LIB */
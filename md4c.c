@@ -31,6 +31,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if (defined __SSE2__ || defined _M_X64) && !defined MD4C_USE_UTF16
+    /* SSE2 is part of every x86-64 CPU. */
+    #include <emmintrin.h>
+    #define MD4C_USE_SSE2
+#endif
+
+#if defined MD4C_USE_SSE2 && defined __x86_64__ && (defined __GNUC__ || defined __clang__) \
+        && !defined MD4C_NO_AVX2
+    /* AVX2 is not, so it is compiled for alone and checked for at run time. */
+    #include <immintrin.h>
+    #define MD4C_USE_AVX2
+#endif
+
 
 /*****************************
  ***  Miscellaneous Stuff  ***
@@ -170,6 +183,7 @@ struct MD_CTX_tag {
     SZ size;
     MD_PARSER parser;
     void* userdata;
+    const MD_SCANNER* scanner;  /* Only set by md_scan(). */
 
     /* When this is true, it allows some optimizations. */
     int doc_ends_with_newline;
@@ -199,6 +213,8 @@ struct MD_CTX_tag {
 #else
     char mark_char_map[256];
 #endif
+    unsigned mark_char_map_flags;   /* Parser flags mark_char_map[] was built for. */
+    int has_mark_char_map;
 
     /* For resolving of inline spans. */
     MD_MARKSTACK opener_stacks[16];
@@ -248,8 +264,10 @@ struct MD_CTX_tag {
      */
     void* block_bytes;
     MD_BLOCK* current_block;
+    int current_block_nested;   /* Current block was started inside a container. */
     int n_block_bytes;
     int alloc_block_bytes;
+    int li_opener_end;          /* n_block_bytes after the last MD_BLOCK_LI opener. */
 
     /* For container block analysis. */
     MD_CONTAINER* containers;
@@ -1867,6 +1885,7 @@ md_free_ref_def_hashtable(MD_CTX* ctx)
         }
 
         free(ctx->ref_def_hashtable);
+        ctx->ref_def_hashtable = NULL;
     }
 }
 
@@ -2435,6 +2454,8 @@ abort:
     return ret;
 }
 
+/* Frees what the reference definitions own; ctx->ref_defs[] itself is kept
+ * for the next document. */
 static void
 md_free_ref_defs(MD_CTX* ctx)
 {
@@ -2448,8 +2469,7 @@ md_free_ref_defs(MD_CTX* ctx)
         if(def->title_needs_free)
             free(def->title);
     }
-
-    free(ctx->ref_defs);
+    ctx->n_ref_defs = 0;
 }
 
 
@@ -2730,6 +2750,12 @@ md_rollback(MD_CTX* ctx, int opener_index, int closer_index, int how)
 static void
 md_build_mark_char_map(MD_CTX* ctx)
 {
+    /* A reused context keeps the map as long as the flags stay the same. */
+    if(ctx->has_mark_char_map  &&  ctx->mark_char_map_flags == ctx->parser.flags)
+        return;
+    ctx->has_mark_char_map = TRUE;
+    ctx->mark_char_map_flags = ctx->parser.flags;
+
     memset(ctx->mark_char_map, 0, sizeof(ctx->mark_char_map));
 
     ctx->mark_char_map['\\'] = 1;
@@ -3000,6 +3026,96 @@ md_is_autolink(MD_CTX* ctx, OFF beg, OFF max_end, OFF* p_end, int* p_missing_mai
     return FALSE;
 }
 
+#ifdef MD4C_USE_AVX2
+/* As md_skip_to_mark_char() below, 32 bytes at a time. Returns the mark char,
+ * or where fewer than 32 bytes are left before end. */
+__attribute__((target("avx2"))) static OFF
+md_skip_to_mark_char_avx2(MD_CTX* ctx, OFF off, OFF end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i letter_min = _mm256_set1_epi8('a');
+    const __m256i letter_range = _mm256_set1_epi8('z' - 'a');
+    const __m256i digit_min = _mm256_set1_epi8('0');
+    const __m256i digit_range = _mm256_set1_epi8('9' - '0');
+    const __m256i space = _mm256_set1_epi8(ctx->mark_char_map[' '] ? 'a' : ' ');
+    int i;
+
+    while(off + 32 <= end) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) STR(off));
+        __m256i plain;
+        uint32_t mask;
+
+        plain = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(_mm256_or_si256(v, case_bit), letter_min), letter_range), zero);
+        plain = _mm256_or_si256(plain, _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, digit_min), digit_range), zero));
+        plain = _mm256_or_si256(plain, _mm256_cmpeq_epi8(v, space));
+
+        mask = ~((uint32_t) _mm256_movemask_epi8(plain) | (uint32_t) _mm256_movemask_epi8(v));
+        for(i = 0; mask != 0; i++, mask >>= 1) {
+            if((mask & 1)  &&  ctx->mark_char_map[(unsigned char) CH(off+i)])
+                goto out;
+        }
+        off += 32;
+    }
+    i = 0;
+
+out:
+    /* Compilers only do this themselves when optimizing; SSE code after
+     * dirty upper halves runs slowly. */
+    _mm256_zeroupper();
+    return off + i;
+}
+#endif
+
+#ifdef MD4C_USE_SSE2
+/* Find the next mark char 16 bytes at a time. Letters, digits, spaces and
+ * non-ASCII bytes are never mark chars (a space only is with
+ * MD_FLAG_COLLAPSEWHITESPACE) and they make up most of any prose; only the
+ * other bytes of a block are looked up in mark_char_map[]. Returns the mark
+ * char, or where fewer than 16 bytes are left before end. */
+static OFF
+md_skip_to_mark_char(MD_CTX* ctx, OFF off, OFF end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i letter_min = _mm_set1_epi8('a');
+    const __m128i letter_range = _mm_set1_epi8('z' - 'a');
+    const __m128i digit_min = _mm_set1_epi8('0');
+    const __m128i digit_range = _mm_set1_epi8('9' - '0');
+    const __m128i space = _mm_set1_epi8(ctx->mark_char_map[' '] ? 'a' : ' ');
+
+#ifdef MD4C_USE_AVX2
+    if(off + 32 <= end  &&  __builtin_cpu_supports("avx2")) {
+        off = md_skip_to_mark_char_avx2(ctx, off, end);
+        if(off < end  &&  ctx->mark_char_map[(unsigned char) CH(off)])
+            return off;
+    }
+#endif
+
+    while(off + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i*) STR(off));
+        __m128i plain;
+        unsigned mask;
+        int i;
+
+        /* x - min, saturated against range, is zero iff min <= x <= min + range. */
+        plain = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(_mm_or_si128(v, case_bit), letter_min), letter_range), zero);
+        plain = _mm_or_si128(plain, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, digit_min), digit_range), zero));
+        plain = _mm_or_si128(plain, _mm_cmpeq_epi8(v, space));
+
+        /* The sign bits of v itself are the non-ASCII bytes. */
+        mask = ~(unsigned) (_mm_movemask_epi8(plain) | _mm_movemask_epi8(v)) & 0xffff;
+        for(i = 0; mask != 0; i++, mask >>= 1) {
+            if((mask & 1)  &&  ctx->mark_char_map[(unsigned char) CH(off+i)])
+                return off + i;
+        }
+        off += 16;
+    }
+
+    return off;
+}
+#endif
+
 static int
 md_collect_marks(MD_CTX* ctx, const MD_LINE* lines, MD_SIZE n_lines, int table_mode)
 {
@@ -3025,6 +3141,12 @@ md_collect_marks(MD_CTX* ctx, const MD_LINE* lines, MD_SIZE n_lines, int table_m
     #define IS_MARK_CHAR(off)   (ctx->mark_char_map[(unsigned char) CH(off)])
 #endif
 
+#ifdef MD4C_USE_SSE2
+            /* Optimization: Skip 16 bytes at a time, the scalar loops
+             * below finish the tail of the line. */
+            off = md_skip_to_mark_char(ctx, off, line->end);
+#endif
+
             /* Optimization: Use some loop unrolling. */
             while(off + 3 < line->end  &&  !IS_MARK_CHAR(off+0)  &&  !IS_MARK_CHAR(off+1)
                                        &&  !IS_MARK_CHAR(off+2)  &&  !IS_MARK_CHAR(off+3))
@@ -4966,6 +5088,7 @@ md_process_all_blocks(MD_CTX* ctx)
     }
 
     ctx->n_block_bytes = 0;
+    ctx->li_opener_end = 0;
 
 abort:
     return ret;
@@ -5054,6 +5177,7 @@ md_start_new_block(MD_CTX* ctx, const MD_LINE_ANALYSIS* line)
     block->n_lines = 0;
 
     ctx->current_block = block;
+    ctx->current_block_nested = (ctx->n_containers > 0);
     return 0;
 }
 
@@ -5092,6 +5216,11 @@ md_consume_link_reference_definitions(MD_CTX* ctx)
     /* If there was at least one reference definition, we need to remove
      * its lines from the block, or perhaps even the whole block. */
     if(n > 0) {
+        if(ctx->scanner != NULL  &&  ctx->scanner->ref_defs != NULL) {
+            ctx->scanner->ref_defs(lines[0].beg, lines[n-1].end,
+                                   ctx->current_block_nested, ctx->userdata);
+        }
+
         if(n == n_lines) {
             /* Remove complete block. */
             ctx->n_block_bytes -= n * sizeof(MD_LINE);
@@ -5199,6 +5328,8 @@ md_push_container_bytes(MD_CTX* ctx, MD_BLOCKTYPE type, unsigned start,
     block->flags = flags;
     block->data = data;
     block->n_lines = start;
+    if(type == MD_BLOCK_LI  &&  (flags & MD_BLOCK_CONTAINER_OPENER))
+        ctx->li_opener_end = ctx->n_block_bytes;
 
 abort:
     return ret;
@@ -5960,9 +6091,13 @@ md_analyze_line(MD_CTX* ctx, OFF beg, OFF* p_end,
                  * end the list because according to the specification, "a list
                  * item can begin with at most one blank line."
                  */
+                /* The lines of a finished block may follow the last MD_BLOCK,
+                 * so only li_opener_end tells the item is still empty; reading
+                 * them as a block would depend on the offsets they hold. */
                 if(n_parents > 0  &&  ctx->containers[n_parents-1].ch != _T('>')  &&
                    n_brothers + n_children == 0  &&  ctx->current_block == NULL  &&
-                   ctx->n_block_bytes > (int) sizeof(MD_BLOCK))
+                   ctx->n_block_bytes > (int) sizeof(MD_BLOCK)  &&
+                   ctx->n_block_bytes == ctx->li_opener_end)
                 {
                     MD_BLOCK* top_block = (MD_BLOCK*) ((char*)ctx->block_bytes + ctx->n_block_bytes - sizeof(MD_BLOCK));
                     if(top_block->type == MD_BLOCK_LI)
@@ -5981,7 +6116,8 @@ md_analyze_line(MD_CTX* ctx, OFF beg, OFF* p_end,
                 if(n_parents > 0  &&  n_parents == ctx->n_containers  &&
                    ctx->containers[n_parents-1].ch != _T('>')  &&
                    n_brothers + n_children == 0  &&  ctx->current_block == NULL  &&
-                   ctx->n_block_bytes > (int) sizeof(MD_BLOCK))
+                   ctx->n_block_bytes > (int) sizeof(MD_BLOCK)  &&
+                   ctx->n_block_bytes == ctx->li_opener_end)
                 {
                     MD_BLOCK* top_block = (MD_BLOCK*) ((char*)ctx->block_bytes + ctx->n_block_bytes - sizeof(MD_BLOCK));
                     if(top_block->type == MD_BLOCK_LI) {
@@ -6383,6 +6519,39 @@ abort:
     return ret;
 }
 
+/* Every reference definition has "]:" right after its label. Without one
+ * anywhere in the document, no link can be waiting for a definition further
+ * down.
+ *
+ * A definition may follow the links using it, so this has to look at the
+ * whole text before the first block can be let out; it stops at the first
+ * "]:". With 8-bit chars, memchr() jumps from one ']' to the next at many
+ * times the speed of the line analysis, which makes the pass a small
+ * fraction of the parse. */
+static int
+md_may_have_ref_defs(MD_CTX* ctx)
+{
+    OFF off = 0;
+
+    while(off + 1 < ctx->size) {
+#if !defined MD4C_USE_UTF16
+        const CHAR* p = (const CHAR*) memchr(STR(off), ']', ctx->size - 1 - off);
+        if(p == NULL)
+            return FALSE;
+        off = (OFF) (p - ctx->text);
+#else
+        if(CH(off) != _T(']')) {
+            off++;
+            continue;
+        }
+#endif
+        if(CH(off+1) == _T(':'))
+            return TRUE;
+        off++;
+    }
+    return FALSE;
+}
+
 static int
 md_process_doc(MD_CTX *ctx)
 {
@@ -6391,6 +6560,7 @@ md_process_doc(MD_CTX *ctx)
     MD_LINE_ANALYSIS* line = &line_buf[0];
     OFF off = 0;
     int ret = 0;
+    int stream_blocks = !md_may_have_ref_defs(ctx);
 
     MD_ENTER_BLOCK(MD_BLOCK_DOC, NULL);
 
@@ -6400,6 +6570,17 @@ md_process_doc(MD_CTX *ctx)
 
         MD_CHECK(md_analyze_line(ctx, off, &off, pivot_line, line));
         MD_CHECK(md_process_line(ctx, &pivot_line, line));
+
+        /* Without reference definitions, the blocks analyzed so far are final
+         * once no block is being built and no container is open: later lines
+         * can neither extend them nor make a list loose. Process them right
+         * away, so the callbacks do not wait for the whole document and the
+         * block buffer only ever holds one top-level block. */
+        if(stream_blocks  &&  ctx->current_block == NULL  &&  ctx->n_containers == 0  &&
+           ctx->n_block_bytes > 0)
+        {
+            MD_CHECK(md_process_all_blocks(ctx));
+        }
     }
 
     md_end_current_block(ctx);
@@ -6439,17 +6620,95 @@ abort:
     return ret;
 }
 
+/* Block analysis only, for md_scan(). The lines are analyzed exactly as
+ * md_process_doc() does, but no block is ever processed: whatever is finished
+ * at top level is dropped, and the caller is told where such a point is. */
+static int
+md_scan_doc(MD_CTX *ctx)
+{
+    const MD_LINE_ANALYSIS* pivot_line = &md_dummy_blank_line;
+    MD_LINE_ANALYSIS line_buf[2];
+    MD_LINE_ANALYSIS* line = &line_buf[0];
+    OFF off = 0;
+    OFF line_beg;
+    int after_blank;
+    int ret = 0;
+
+    while(off < ctx->size) {
+        if(line == pivot_line)
+            line = (line == &line_buf[0] ? &line_buf[1] : &line_buf[0]);
+
+        /* Nothing before this line is open, nor may it be continued by it. */
+        after_blank = (off > 0  &&  pivot_line->type == MD_LINE_BLANK  &&
+                       ctx->current_block == NULL  &&  ctx->scanner->cut != NULL);
+        if(after_blank  &&  ctx->n_containers == 0) {
+            ret = ctx->scanner->cut(off, ctx->userdata);
+            if(ret != 0) {
+                MD_LOG("Aborted from cut() callback.");
+                goto abort;
+            }
+            after_blank = FALSE;
+        }
+
+        line_beg = off;
+        MD_CHECK(md_analyze_line(ctx, off, &off, pivot_line, line));
+        MD_CHECK(md_process_line(ctx, &pivot_line, line));
+
+        /* Containers left open by the blank line, e.g. a list, which this
+         * line has closed at top level. */
+        if(after_blank  &&  ctx->n_containers == 0) {
+            ret = ctx->scanner->cut(line_beg, ctx->userdata);
+            if(ret != 0) {
+                MD_LOG("Aborted from cut() callback.");
+                goto abort;
+            }
+        }
+
+        if(ctx->current_block == NULL  &&  ctx->n_containers == 0) {
+            ctx->n_block_bytes = 0;
+            ctx->li_opener_end = 0;
+        }
+    }
+
+    MD_CHECK(md_end_current_block(ctx));
+
+abort:
+    return ret;
+}
+
 
 /********************
  ***  Public API  ***
  ********************/
 
-int
-md_parse(const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata)
+MD_PARSE_CTX*
+md_parse_ctx_new(void)
 {
-    MD_CTX ctx;
+    MD_CTX* ctx = malloc(sizeof(MD_CTX));
+
+    if(ctx != NULL)
+        memset(ctx, 0, sizeof(MD_CTX));
+    return ctx;
+}
+
+void
+md_parse_ctx_free(MD_PARSE_CTX* ctx)
+{
+    if(ctx == NULL)
+        return;
+    free(ctx->buffer);
+    free(ctx->ref_defs);
+    free(ctx->marks);
+    free(ctx->block_bytes);
+    free(ctx->containers);
+    free(ctx);
+}
+
+static int
+md_setup_ctx(MD_CTX* ctx, const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata)
+{
+    MD_CTX keep;
     int i;
-    int ret;
 
     if(parser->abi_version != 0) {
         if(parser->debug_log != NULL)
@@ -6457,33 +6716,95 @@ md_parse(const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userd
         return -1;
     }
 
-    /* Setup context structure. */
-    memset(&ctx, 0, sizeof(MD_CTX));
-    ctx.text = text;
-    ctx.size = size;
-    memcpy(&ctx.parser, parser, sizeof(MD_PARSER));
-    ctx.userdata = userdata;
-    ctx.code_indent_offset = (ctx.parser.flags & MD_FLAG_NOINDENTEDCODEBLOCKS) ? (OFF)(-1) : 4;
-    md_build_mark_char_map(&ctx);
-    ctx.doc_ends_with_newline = (size > 0  &&  ISNEWLINE_(text[size-1]));
-    ctx.max_ref_def_output = MIN(MIN(16 * (uint64_t)size, (uint64_t)(1024 * 1024)), (uint64_t)SZ_MAX);
+    /* Setup context structure. Only the growable buffers and the mark char
+     * map survive from the previous document. */
+    memcpy(&keep, ctx, sizeof(MD_CTX));
+    memset(ctx, 0, sizeof(MD_CTX));
+    ctx->buffer = keep.buffer;
+    ctx->alloc_buffer = keep.alloc_buffer;
+    ctx->ref_defs = keep.ref_defs;
+    ctx->alloc_ref_defs = keep.alloc_ref_defs;
+    ctx->marks = keep.marks;
+    ctx->alloc_marks = keep.alloc_marks;
+    ctx->block_bytes = keep.block_bytes;
+    ctx->alloc_block_bytes = keep.alloc_block_bytes;
+    ctx->containers = keep.containers;
+    ctx->alloc_containers = keep.alloc_containers;
+    if(keep.has_mark_char_map) {
+        memcpy(ctx->mark_char_map, keep.mark_char_map, sizeof(ctx->mark_char_map));
+        ctx->mark_char_map_flags = keep.mark_char_map_flags;
+        ctx->has_mark_char_map = TRUE;
+    }
+
+    ctx->text = text;
+    ctx->size = size;
+    memcpy(&ctx->parser, parser, sizeof(MD_PARSER));
+    ctx->userdata = userdata;
+    ctx->code_indent_offset = (ctx->parser.flags & MD_FLAG_NOINDENTEDCODEBLOCKS) ? (OFF)(-1) : 4;
+    md_build_mark_char_map(ctx);
+    ctx->doc_ends_with_newline = (size > 0  &&  ISNEWLINE_(text[size-1]));
+    ctx->max_ref_def_output = MIN(MIN(16 * (uint64_t)size, (uint64_t)(1024 * 1024)), (uint64_t)SZ_MAX);
 
     /* Reset all mark stacks and lists. */
-    for(i = 0; i < (int) SIZEOF_ARRAY(ctx.opener_stacks); i++)
-        ctx.opener_stacks[i].top = -1;
-    ctx.ptr_stack.top = -1;
-    ctx.unresolved_link_head = -1;
-    ctx.unresolved_link_tail = -1;
-    ctx.table_cell_boundaries_head = -1;
-    ctx.table_cell_boundaries_tail = -1;
+    for(i = 0; i < (int) SIZEOF_ARRAY(ctx->opener_stacks); i++)
+        ctx->opener_stacks[i].top = -1;
+    ctx->ptr_stack.top = -1;
+    ctx->unresolved_link_head = -1;
+    ctx->unresolved_link_tail = -1;
+    ctx->table_cell_boundaries_head = -1;
+    ctx->table_cell_boundaries_tail = -1;
+
+    return 0;
+}
+
+int
+md_parse_ex(MD_PARSE_CTX* ctx, const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata)
+{
+    int ret;
+
+    if(md_setup_ctx(ctx, text, size, parser, userdata) != 0)
+        return -1;
 
     /* All the work. */
-    ret = md_process_doc(&ctx);
+    ret = md_process_doc(ctx);
+
+    /* Clean-up. The hashtable is only built for documents with reference
+     * definitions and sized for them, so it is not kept. */
+    md_free_ref_def_hashtable(ctx);
+    md_free_ref_defs(ctx);
+
+    return ret;
+}
+
+int
+md_scan(MD_PARSE_CTX* ctx, const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser,
+        const MD_SCANNER* scanner, void* userdata)
+{
+    int ret;
+
+    if(md_setup_ctx(ctx, text, size, parser, userdata) != 0)
+        return -1;
+    ctx->scanner = scanner;
+
+    ret = md_scan_doc(ctx);
+
+    md_free_ref_defs(ctx);
+    ctx->scanner = NULL;
+
+    return ret;
+}
+
+int
+md_parse(const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata)
+{
+    MD_CTX ctx;
+    int ret;
+
+    memset(&ctx, 0, sizeof(MD_CTX));
+    ret = md_parse_ex(&ctx, text, size, parser, userdata);
 
-    /* Clean-up. */
-    md_free_ref_defs(&ctx);
-    md_free_ref_def_hashtable(&ctx);
     free(ctx.buffer);
+    free(ctx.ref_defs);
     free(ctx.marks);
     free(ctx.block_bytes);
     free(ctx.containers);
@@ -400,6 +400,42 @@ typedef MD_PARSER MD_RENDERER;
 int md_parse(const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata);
 
 
+/* Parser context which keeps its work buffers from one document to the next,
+ * so that parsing many documents in a row does not allocate once the buffers
+ * have grown to fit them. A context may only be used by one thread at a time.
+ *
+ * md_parse_ctx_new() returns NULL when out of memory. md_parse_ex() behaves
+ * as md_parse().
+ */
+typedef struct MD_CTX_tag MD_PARSE_CTX;
+
+MD_PARSE_CTX* md_parse_ctx_new(void);
+void md_parse_ctx_free(MD_PARSE_CTX* ctx);
+int md_parse_ex(MD_PARSE_CTX* ctx, const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser, void* userdata);
+
+/* Block structure scan, for callers which want to split a big document and
+ * parse the pieces independently. md_scan() analyzes the blocks as
+ * md_parse_ex() does, but calls none of the parser callbacks.
+ *
+ * cut() is called with the offset of each line before which every block is
+ * complete and at top level, i.e. the text before the offset parses the same
+ * way on its own. Returning non-zero stops the scan; md_scan() then returns
+ * that value.
+ *
+ * ref_defs() is called with the range of each run of link reference
+ * definitions. The definitions apply to the whole document, so the pieces
+ * need them too. Definitions inside a container block (nested != 0) are
+ * mixed with the container marks and cannot be moved as plain text.
+ */
+typedef struct MD_SCANNER {
+    int (*cut)(MD_OFFSET off, void* userdata);
+    void (*ref_defs)(MD_OFFSET beg, MD_OFFSET end, int nested, void* userdata);
+} MD_SCANNER;
+
+int md_scan(MD_PARSE_CTX* ctx, const MD_CHAR* text, MD_SIZE size, const MD_PARSER* parser,
+            const MD_SCANNER* scanner, void* userdata);
+
+
 #ifdef __cplusplus
     }  /* extern "C" { */
 #endif
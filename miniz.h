@@ -245,6 +245,8 @@ extern "C"
 #define MZ_CRC32_INIT (0)
     /* mz_crc32() returns the initial CRC-32 value to use when called with ptr==NULL. */
     MINIZ_EXPORT mz_ulong mz_crc32(mz_ulong crc, const unsigned char *ptr, size_t buf_len);
+    /* mz_crc32_combine() returns the CRC-32 of two buffers one after the other, given the CRC-32 of each and the length of the second. */
+    MINIZ_EXPORT mz_ulong mz_crc32_combine(mz_ulong crc1, mz_ulong crc2, size_t len2);
 
     /* Compression strategies. */
     enum
@@ -0,0 +1,182 @@
+#!/bin/sh
+# Regression checks for make check, run from the source directory
+
+T=$(mktemp -d) || exit 1
+failed=0
+daemon=
+
+cleanup() {
+	[ -n "$daemon" ] && kill "$daemon" 2>/dev/null
+	rm -rf "$T"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ok() {
+	echo "ok   $1"
+}
+
+fail() {
+	echo "FAIL $1"
+	failed=1
+}
+
+# same name a b: pass when a is not empty and b has the same bytes
+same() {
+	if [ -s "$2" ] && cmp -s "$2" "$3"; then ok "$1"; else fail "$1"; fi
+}
+
+# body docx: the contents of w:body in the docx's document.xml
+body() {
+	./test/zipcat "$1" word/document.xml | tr -d '\n' |
+		sed 's/.*<w:body>//; s/<\/w:body>.*//'
+}
+
+# double file n: concatenate file with itself n times, in place
+double() {
+	i=0
+	while [ $i -lt "$2" ]; do
+		cat "$1" "$1" >"$T/double" && mv "$T/double" "$1"
+		i=$((i + 1))
+	done
+}
+
+# check name expected command...: pass when the command succeeds and
+# prints exactly the expected file, which is not empty
+check() {
+	name=$1 expected=$2
+	shift 2
+	if [ -s "$expected" ] && "$@" >"$T/out" 2>/dev/null && cmp -s "$expected" "$T/out"; then
+		ok "$name"
+	else
+		fail "$name"
+	fi
+}
+
+# mz_crc32 against a bitwise CRC-32, with and without PCLMULQDQ
+for crc in crc32 crc32-nopclmul; do
+	if ./test/$crc; then ok "$crc"; else fail "$crc"; fi
+done
+
+# daemon: one conversion and one refused path request
+./doctxtd -s "$T/sock" -j 2 &
+daemon=$!
+./doctxt test/test.docx -o "$T/plain.txt" 2>/dev/null
+check "doctxtd docx -> txt" "$T/plain.txt" ./test/dtclient "$T/sock" 1 0 "" test/test.docx
+./test/dtclient "$T/sock" 1 1 "" "$PWD/test/test.docx" >/dev/null
+if [ $? -eq 2 ]; then ok "doctxtd refuses paths without -r"
+else fail "doctxtd refuses paths without -r"; fi
+printf '![a](%s/test/test-image.png)\n' "$PWD" >"$T/image.md"
+./test/dtclient "$T/sock" 3 0 "" "$T/image.md" >"$T/image.docx"
+if [ $? -eq 0 ] && ! ./test/zipcat "$T/image.docx" word/media/image1.png >/dev/null 2>&1
+then ok "doctxtd reads no markdown images without -r"
+else fail "doctxtd reads no markdown images without -r"; fi
+kill "$daemon" && wait "$daemon"
+if [ $? -eq 0 ] && [ ! -e "$T/sock" ]; then ok "doctxtd stops on TERM"
+else fail "doctxtd stops on TERM"; fi
+
+# daemon with a root: markdown images only from below it
+./doctxtd -s "$T/sock" -j 1 -r test &
+daemon=$!
+printf '![b](../README.md) ![c](%s/Makefile) ![a](test-image.png)\n' "$PWD" >"$T/image.md"
+./test/dtclient "$T/sock" 3 0 "" "$T/image.md" >"$T/image.docx"
+check "doctxtd reads markdown images below -r" test/test-image.png \
+	./test/zipcat "$T/image.docx" word/media/image1.png
+n=$(./test/zipcat "$T/image.docx" word/document.xml | grep -o '<w:drawing>' | wc -l)
+if [ "$n" -eq 1 ]; then ok "doctxtd leaves out markdown images outside -r"
+else fail "doctxtd leaves out markdown images outside -r"; fi
+kill "$daemon" && wait "$daemon"
+daemon=
+
+# doctxt: body, and all text parts in part order whatever the zip order
+check "doctxt body" test/parts.txt ./doctxt test/parts.docx -o -
+check "doctxt -a" test/parts-all.txt ./doctxt test/parts.docx -a -o -
+if ./doctxt test/parts.docx -c -a -o - >/dev/null 2>&1; then fail "doctxt refuses -c -a"
+else ok "doctxt refuses -c -a"; fi
+
+# doctxt previews: the head of the full output, however much text sits in
+# content controls and tables before the body paragraphs
+for n in 1 5 12 13; do
+	head -n $n test/parts.txt >"$T/head.txt"
+	check "doctxt --max-paragraphs $n" "$T/head.txt" ./doctxt test/parts.docx --max-paragraphs $n -o -
+done
+head -n 3 "$T/plain.txt" >"$T/head.txt"
+check "doctxt --max-paragraphs 3 test.docx" "$T/head.txt" ./doctxt test/test.docx --max-paragraphs 3 -o -
+printf 'Body paragraph 1 with Grü' >"$T/head.txt"
+check "doctxt --max-chars 25" "$T/head.txt" ./doctxt test/parts.docx --max-chars 25 -o -
+check "doctxt --max-chars 1000" test/parts.txt ./doctxt test/parts.docx --max-chars 1000 -o -
+
+# doctxt -m: one record per file, from a path or from stdin
+printf 'test/parts.docx\tParts test\tAnn & Bob\t2024-01-02T03:04:05Z\t1\t70\t420\t8025\t159b31af\n' >"$T/meta.txt"
+check "doctxt -m" "$T/meta.txt" ./doctxt -m test/parts.docx -o -
+sed 's|^test/parts.docx|-|' "$T/meta.txt" >"$T/stdin.txt"
+check "doctxt -m -" "$T/stdin.txt" sh -c './doctxt -m - -o - <test/parts.docx'
+
+# docx2md styles: localized and inherited headings, quotes, code, and
+# lists from numbering.xml, also past the threshold for parallel chunks,
+# which four threads split into two chunks
+check "docx2md styles" test/styles.md ./docx2md test/styles.docx -o -
+i=0
+while [ $i -lt 120 ]; do cat test/styles.md; i=$((i + 1)); done >"$T/large.md"
+check "docx2md styles, large body" "$T/large.md" \
+	env DOCTXT_THREADS=4 ./docx2md test/styles-large.docx -o -
+
+# docx2md runs: toggles switched off by w:val, code runs, line breaks
+check "docx2md runs" test/runs.md ./docx2md test/runs.docx -o -
+
+# md2docx: test/blocks.md ends every top-level block, so 4096 copies of it,
+# cut into four chunks for four threads, must give its body 4096 times
+./md2docx test/blocks.md -o "$T/blocks.docx" >/dev/null 2>&1
+body "$T/blocks.docx" >"$T/blocks.body"
+cp test/blocks.md "$T/large.md"
+cp "$T/blocks.body" "$T/large.body"
+double "$T/large.md" 12
+double "$T/large.body" 12
+DOCTXT_THREADS=4 ./md2docx "$T/large.md" -o "$T/large.docx" >/dev/null 2>&1
+body "$T/large.docx" >"$T/out.body"
+same "md2docx large input" "$T/large.body" "$T/out.body"
+
+# md2docx --cache: the same document.xml as without the cache, when the
+# cache is cold and when all but an edited section come from it
+./test/zipcat "$T/large.docx" word/document.xml >"$T/large.xml"
+./md2docx "$T/large.md" -o "$T/cold.docx" --cache "$T/cache" >/dev/null 2>&1
+check "md2docx --cache, cold" "$T/large.xml" ./test/zipcat "$T/cold.docx" word/document.xml
+sed '1s/.*/# Edited heading/' "$T/large.md" >"$T/edited.md"
+./md2docx "$T/edited.md" -o "$T/edited.docx" >/dev/null 2>&1
+./test/zipcat "$T/edited.docx" word/document.xml >"$T/edited.xml"
+./md2docx "$T/edited.md" -o "$T/warm.docx" --cache "$T/cache" >/dev/null 2>&1
+check "md2docx --cache, edited" "$T/edited.xml" ./test/zipcat "$T/warm.docx" word/document.xml
+
+# md2docx --reproducible: the same bytes a while later, with the content
+# of a plain conversion. The output cache must return a document as it was
+# first written, dates and all, even after that while.
+./md2docx test/image-test.md -o "$T/plain.docx" >/dev/null 2>&1
+./test/zipcat "$T/plain.docx" word/document.xml >"$T/plain.xml"
+./md2docx test/image-test.md -o "$T/first.docx" --cache "$T/cache" >/dev/null 2>&1
+./md2docx test/image-test.md -o "$T/repro1.docx" --reproducible >/dev/null 2>&1
+sleep 2
+./md2docx test/image-test.md -o "$T/repro2.docx" --reproducible >/dev/null 2>&1
+./md2docx test/image-test.md -o "$T/again.docx" --cache "$T/cache" >/dev/null 2>&1
+same "md2docx --reproducible, twice" "$T/repro1.docx" "$T/repro2.docx"
+check "md2docx --reproducible, content" "$T/plain.xml" ./test/zipcat "$T/repro1.docx" word/document.xml
+check "md2docx --reproducible, image" test/test-image.png ./test/zipcat "$T/repro1.docx" word/media/image1.png
+check "md2docx --cache, converted" "$T/plain.xml" ./test/zipcat "$T/first.docx" word/document.xml
+same "md2docx --cache, unchanged" "$T/first.docx" "$T/again.docx"
+
+# md2docx -d: inputs sharing a basename are refused before anything is
+# written, other inputs convert as they do alone
+mkdir -p "$T/a" "$T/b" "$T/batch"
+cp test/blocks.md "$T/a/doc.md"
+cp test/image-test.md "$T/b/doc.md"
+if ./md2docx -d "$T/batch" "$T/a/doc.md" "$T/b/doc.md" >/dev/null 2>&1 ||
+   [ -e "$T/batch/doc.docx" ]; then
+	fail "md2docx -d, same basename"
+else
+	ok "md2docx -d, same basename"
+fi
+printf '%s\n' "$T/a/doc.md" test/image-test.md | ./md2docx -d "$T/batch" -j 2 >/dev/null 2>&1
+./test/zipcat "$T/blocks.docx" word/document.xml >"$T/blocks.xml"
+check "md2docx -d, first input" "$T/blocks.xml" ./test/zipcat "$T/batch/doc.docx" word/document.xml
+check "md2docx -d, second input" "$T/plain.xml" ./test/zipcat "$T/batch/image-test.docx" word/document.xml
+
+exit $failed
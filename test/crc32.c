@@ -0,0 +1,87 @@
+/*
+ * crc32 - Compare mz_crc32 with a bitwise CRC-32, for make check
+ *
+ * Covers every length up to a few hundred bytes at every alignment, some
+ * long buffers, buffers fed in pieces and mz_crc32_combine.  Built once as
+ * is and once with MINIZ_NO_CRC32_PCLMUL, to test both code paths.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniz.h"
+
+#define BUF_SIZE (256 * 1024)
+#define SHORT_MAX 600
+
+static unsigned long failures;
+
+static mz_uint32 crc32_bitwise(mz_uint32 crc, const mz_uint8 *p, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+static void expect(const char *what, size_t off, size_t len, mz_uint32 got, mz_uint32 want)
+{
+    if (got == want)
+        return;
+    if (failures++ < 10)
+        fprintf(stderr, "crc32: %s at offset %zu, length %zu: %08lx, not %08lx\n",
+                what, off, len, (unsigned long)got, (unsigned long)want);
+}
+
+int main(void)
+{
+    static const size_t long_lens[] = {
+        1024, 4095, 4096, 4097, 65535, 65536, 65536 + 13, BUF_SIZE - 16
+    };
+    static const size_t splits[] = { 1, 15, 16, 17, 63, 64, 65, 1000, 4096 };
+    mz_uint8 *buf;
+    mz_uint32 x = 2463534242u;
+
+    if (!(buf = malloc(BUF_SIZE))) {
+        fprintf(stderr, "crc32: out of memory\n");
+        return 1;
+    }
+    /* xorshift32 */
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = x >> 24;
+    }
+
+    expect("check value", 0, 9, (mz_uint32)mz_crc32(MZ_CRC32_INIT, (const mz_uint8 *)"123456789", 9),
+           0xCBF43926);
+    for (size_t off = 0; off < 16; off++) {
+        for (size_t len = 0; len <= SHORT_MAX; len++)
+            expect("short", off, len, (mz_uint32)mz_crc32(MZ_CRC32_INIT, buf + off, len),
+                   crc32_bitwise(0, buf + off, len));
+    }
+    for (size_t i = 0; i < sizeof(long_lens) / sizeof(*long_lens); i++) {
+        for (size_t off = 0; off < 16; off += 5) {
+            size_t len = long_lens[i];
+            mz_uint32 want = crc32_bitwise(0, buf + off, len);
+            expect("long", off, len, (mz_uint32)mz_crc32(MZ_CRC32_INIT, buf + off, len), want);
+
+            for (size_t j = 0; j < sizeof(splits) / sizeof(*splits) && splits[j] < len; j++) {
+                size_t a = splits[j];
+                mz_uint32 first = (mz_uint32)mz_crc32(MZ_CRC32_INIT, buf + off, a);
+                mz_uint32 second = (mz_uint32)mz_crc32(MZ_CRC32_INIT, buf + off + a, len - a);
+                expect("pieces", off, len, (mz_uint32)mz_crc32(first, buf + off + a, len - a), want);
+                expect("combine", off, len, (mz_uint32)mz_crc32_combine(first, second, len - a), want);
+            }
+        }
+    }
+    free(buf);
+    if (failures)
+        fprintf(stderr, "crc32: %lu mismatches\n", failures);
+    return failures != 0;
+}
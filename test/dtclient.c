@@ -0,0 +1,138 @@
+/*
+ * dtclient - Send one request to doctxtd, for make check
+ *
+ * usage: dtclient socket op flags opt input
+ *
+ * The input file is sent as the request body, or with flags & 1 the input
+ * argument itself is sent as a path.  The reply is written to stdout and
+ * the exit status is the reply status.  Connecting is retried for a few
+ * seconds so the daemon may still be starting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "doctxt.h"
+#include "util.h"
+
+#define MAGIC 0x44545844u             /* "DTXD" */
+#define CONNECT_TRIES 100             /* 50 ms apart */
+
+static void read_full(int fd, void *data, size_t size)
+{
+    char *p = data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("read: short reply");
+        p += n;
+        size -= n;
+    }
+}
+
+static void write_full(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("write:");
+        p += n;
+        size -= n;
+    }
+}
+
+static uint32_t read_u32(int fd)
+{
+    uint32_t v;
+
+    read_full(fd, &v, sizeof(v));
+    return ntohl(v);
+}
+
+static int connect_socket(const char *path)
+{
+    struct timespec pause = { 0, 50000000 };
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        die("Socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    for (int i = 0; i < CONNECT_TRIES; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            die("socket:");
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        nanosleep(&pause, NULL);
+    }
+    die("connect %s:", path);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char header[12];
+    const char *opt, *input;
+    char *data, chunk[65536];
+    size_t len;
+    uint32_t status, n;
+    int fd, flags;
+
+    if (argc != 6) {
+        fprintf(stderr, "usage: dtclient socket op flags opt input\n");
+        return 1;
+    }
+    flags = atoi(argv[3]);
+    opt = argv[4];
+    input = argv[5];
+    if (flags & 1) {
+        len = strlen(input);
+        data = NULL;
+    } else if (!(data = readfile(input, &len))) {
+        die("%s:", input);
+    }
+
+    fd = connect_socket(argv[1]);
+    n = htonl(MAGIC);
+    memcpy(header, &n, 4);
+    header[4] = atoi(argv[2]);
+    header[5] = flags;
+    header[6] = strlen(opt) >> 8;
+    header[7] = strlen(opt) & 0xff;
+    n = htonl(len);
+    memcpy(header + 8, &n, 4);
+    write_full(fd, header, sizeof(header));
+    write_full(fd, opt, strlen(opt));
+    write_full(fd, data ? data : input, len);
+
+    status = read_u32(fd);
+    while ((n = read_u32(fd)) > 0) {
+        while (n > 0) {
+            size_t part = n < sizeof(chunk) ? n : sizeof(chunk);
+            read_full(fd, chunk, part);
+            fwrite(chunk, 1, part, stdout);
+            n -= part;
+        }
+    }
+    close(fd);
+    free(data);
+    return status;
+}
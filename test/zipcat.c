@@ -0,0 +1,35 @@
+/*
+ * zipcat - Print one part of a zip archive, for make check
+ *
+ * usage: zipcat archive name
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "miniz.h"
+
+int main(int argc, char *argv[])
+{
+    mz_zip_archive zip = {0};
+    size_t size;
+    void *data;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: zipcat archive name\n");
+        return 1;
+    }
+    if (!mz_zip_reader_init_file(&zip, argv[1], 0)) {
+        fprintf(stderr, "zipcat: %s: not a zip archive\n", argv[1]);
+        return 1;
+    }
+    if (!(data = mz_zip_reader_extract_file_to_heap(&zip, argv[2], &size, 0))) {
+        fprintf(stderr, "zipcat: %s: no part %s\n", argv[1], argv[2]);
+        mz_zip_reader_end(&zip);
+        return 1;
+    }
+    fwrite(data, 1, size, stdout);
+    mz_free(data);
+    mz_zip_reader_end(&zip);
+    return 0;
+}
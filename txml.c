@@ -0,0 +1,5 @@
+/* See LICENSE file for copyright and license details. */
+/* Single translation unit holding the txml implementation, so the tools
+ * and the daemon can share one copy of it. */
+#define TXML_DEFINE
+#include "txml.h"
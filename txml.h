@@ -72,6 +72,12 @@ TXML_EXTERN char *txml_parse(
 	returns <NULL> if <data> could be parsed completely
 */
 
+TXML_EXTERN char *txml_parse_ex(
+	char *data, size_t max_nodes, struct txml_node *nodes, _Bool *malformed);
+/*	same as <txml_parse()>, but sets <*malformed> when parsing stopped on
+	invalid XML rather than on running out of nodes
+*/
+
 TXML_EXTERN char *txml_read_file(const char *filename);
 /*	read entire file into null terminated character array
 
@@ -83,7 +89,8 @@ TXML_EXTERN char *txml_parse_file(char *filename, struct txml_node **nodes);
 	data and filles the nodes list
 
 	returns <NULL> if <data> could NOT be parsed completely otherwise ,data. which needs
-	to be freed!
+	to be freed! On failure nothing is left allocated and nothing is
+	printed, so long-running callers can simply skip the document.
 */
 
 TXML_EXTERN struct txml_node *txml_next(
@@ -299,12 +306,11 @@ static inline void put_node_(
 char *txml_read_file(const char *filename)
 {
 	char *buffer = 0;
-	size_t length;
+	long length;
 	
 	// Open file
 	FILE *file = fopen(filename, "rb");
 	if (!file) {
-		fprintf(stderr, "Unable to open %s\n", filename);
 		return NULL;
 	}
 
@@ -316,9 +322,16 @@ char *txml_read_file(const char *filename)
 	fseek(file, 0, SEEK_SET);
 
 	// Allocate space
-	buffer = malloc(length + 1);
+	if (length < 0 || !(buffer = malloc(length + 1))) {
+		fclose(file);
+		return NULL;
+	}
 	// Read file content
-	fread(buffer, 1, length, file);
+	if (fread(buffer, 1, length, file) != (size_t)length) {
+		fclose(file);
+		free(buffer);
+		return NULL;
+	}
 
 	// Close the file
 	fclose(file);
@@ -331,7 +344,7 @@ char *txml_read_file(const char *filename)
 
 char *txml_parse_file(char *filename, struct txml_node **nodes)
 {
-	char *data;
+	_Bool malformed = 0;
 	char *doc = txml_read_file(filename);
 	if (!doc) {
 		return NULL;
@@ -339,17 +352,21 @@ char *txml_parse_file(char *filename, struct txml_node **nodes)
 
 	size_t allocated = 31250; // 1 Mb
 	struct txml_node *lnodes = malloc(allocated * sizeof(struct txml_node));
-	while ((data = txml_parse(doc, allocated, lnodes))) {
-		//fprintf(stderr, "Reallocating...");
+	// Only running out of nodes is worth a retry, invalid XML stays invalid
+	while (lnodes && txml_parse_ex(doc, allocated, lnodes, &malformed) && !malformed) {
 		free(doc);
 		free(lnodes);
 		allocated *= 2;
 		lnodes = malloc(allocated * sizeof(struct txml_node));
-		if (!lnodes) {
-			fprintf(stderr, "Unable to allocate sufficient memory\n");
+		if (!lnodes || !(doc = txml_read_file(filename))) {
+			free(lnodes);
 			return NULL;
 		}
-		doc = txml_read_file(filename);
+	}
+	if (!lnodes || malformed) {
+		free(doc);
+		free(lnodes);
+		return NULL;
 	}
 
 	//fprintf(stderr, "Allocated: %li nodes (%li Mb)\n", allocated, (allocated * 32) / 1000000);
@@ -359,6 +376,13 @@ char *txml_parse_file(char *filename, struct txml_node **nodes)
 
 char *txml_parse(
 	char *data, size_t count, struct txml_node *nodes)
+{
+	_Bool malformed;
+	return txml_parse_ex(data, count, nodes, &malformed);
+}
+
+char *txml_parse_ex(
+	char *data, size_t count, struct txml_node *nodes, _Bool *malformed)
 {
 	enum txml_parse_states txml_parse_state = TXML_PARSE_TEXT;
 	int error_number;
@@ -366,6 +390,7 @@ char *txml_parse(
 	char *start;
 	char c;
 	struct txml_node *parent = nodes;
+	*malformed = 0;
 	put_node(TXML_EOF, NULL, NULL, NULL);
 
 	for (;;) {
@@ -610,14 +635,16 @@ char *txml_parse(
 				txml_parse_state = TXML_PARSE_ERROR;
 				break;
 			case TXML_PARSE_ERROR:
-				fprintf(stderr, "Error during state %s at: %.20s...\n", txml_parse_names[error_number], data);
+				// error_number names the state that failed, see txml_parse_names
+				(void)error_number;
+				*malformed = 1;
 				return data;
 				break;
 			case TXML_PARSE_FINISHED:
 				return NULL;
 				break;
 			default:
-				fprintf(stderr, "Unknown parse state!\n");
+				error_number = txml_parse_state;
 				txml_parse_state = TXML_PARSE_ERROR;
 				break;
 		}
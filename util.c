@@ -4,9 +4,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "miniz.h"
+#include "txml.h"
+#include "doctxt.h"
 #include "util.h"
 
+#define ARENA_MIN       (64 * 1024)
+#define ARENA_MAX       (4 * 1024 * 1024)
+
+/* arena blocks stay chained to the context and are reused by later
+ * documents; blocks past arena_cur hold stale data */
+struct dt_block {
+	struct dt_block *next;
+	size_t size;
+	size_t used;
+	union { long double ld; long long ll; void *p; } data[];
+};
+
+#define ARENA_ALIGN     sizeof(((struct dt_block *)0)->data[0])
+
 void *
 xmalloc(size_t len)
 {
@@ -44,3 +65,480 @@ die(const char *fmt, ...) {
 
 	exit(1);
 }
+
+/* read fp to the end into a NUL-terminated buffer, NULL on failure */
+static char *
+readstream(FILE *fp, size_t *len)
+{
+	char *buf, *p;
+	size_t size = 0, cap = BUFSIZ, n;
+
+	if (!(buf = malloc(cap + 1)))
+		return NULL;
+	while ((n = fread(buf + size, 1, cap - size, fp)) > 0) {
+		size += n;
+		if (size == cap) {
+			if (!(p = realloc(buf, cap * 2 + 1)))
+				goto fail;
+			buf = p;
+			cap *= 2;
+		}
+	}
+	if (ferror(fp))
+		goto fail;
+	buf[size] = '\0';
+	*len = size;
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+/* read the whole file into a NUL-terminated buffer, NULL on failure;
+ * "-" reads standard input */
+char *
+readfile(const char *path, size_t *len)
+{
+	FILE *fp;
+	char *buf;
+
+	if (!strcmp(path, "-"))
+		return readstream(stdin, len);
+	if (!(fp = fopen(path, "rb")))
+		return NULL;
+	buf = readstream(fp, len);
+	fclose(fp);
+	return buf;
+}
+
+/* write len bytes to path, "-" being standard output; 0 on failure */
+int
+writefile(const char *path, const void *data, size_t len)
+{
+	FILE *fp;
+	int ok;
+
+	if (!strcmp(path, "-"))
+		fp = stdout;
+	else if (!(fp = fopen(path, "wb")))
+		return 0;
+	ok = fwrite(data, 1, len, fp) == len;
+	if (fp == stdout)
+		return fflush(fp) == 0 && ok;
+	return fclose(fp) == 0 && ok;
+}
+
+/* map the whole file read-only, so only the pages a conversion touches
+ * are read; "-", pipes and other files that cannot be mapped are read
+ * instead. *mapped tells which; NULL on failure, release with
+ * unmapfile() */
+const char *
+mapfile(const char *path, size_t *len, int *mapped)
+{
+	struct stat st;
+	FILE *fp;
+	void *p;
+	int fd;
+
+	*mapped = 0;
+	if (!strcmp(path, "-"))
+		return readfile(path, len);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		if (!(fp = fdopen(fd, "rb"))) {
+			close(fd);
+			return NULL;
+		}
+		p = readstream(fp, len);
+		fclose(fp);
+		return p;
+	}
+	*len = st.st_size;
+	*mapped = 1;
+	p = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+void
+unmapfile(const char *p, size_t len, int mapped)
+{
+	if (!mapped)
+		free((void *)p);
+	else if (len)
+		munmap((void *)p, len);
+}
+
+/* threads to convert one large document on: those set in ctx, if not
+ * NULL, $DOCTXT_THREADS, or else one per online CPU */
+long
+dt_threads(const doctxt_ctx *ctx)
+{
+	const char *env = getenv("DOCTXT_THREADS");
+	long n = env ? strtol(env, NULL, 10) : 0;
+
+	if (ctx && ctx->threads > 0)
+		return ctx->threads;
+
+	if (n < 1)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
+static void *
+std_malloc(void *opaque, size_t size)
+{
+	return malloc(size);
+}
+
+static void *
+std_realloc(void *opaque, void *p, size_t size)
+{
+	return realloc(p, size);
+}
+
+static void
+std_free(void *opaque, void *p)
+{
+	free(p);
+}
+
+doctxt_ctx *
+doctxt_new(const doctxt_allocator *alloc)
+{
+	static const doctxt_allocator std = { std_malloc, std_realloc, std_free, NULL };
+	doctxt_ctx *ctx;
+
+	if (!alloc)
+		alloc = &std;
+	if (!(ctx = alloc->malloc(alloc->opaque, sizeof(*ctx))))
+		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->alloc = *alloc;
+	return ctx;
+}
+
+void
+doctxt_free(doctxt_ctx *ctx)
+{
+	struct dt_block *b, *next;
+
+	if (!ctx)
+		return;
+	for (b = ctx->arena; b; b = next) {
+		next = b->next;
+		dt_free(ctx, b);
+	}
+	dt_free(ctx, ctx->out);
+	dt_free(ctx, ctx->xml);
+	dt_free(ctx, ctx->cache_dir);
+	dt_free(ctx, ctx->link_dir);
+	dt_free(ctx, ctx->image_dir);
+	if (ctx->md_free)
+		ctx->md_free(ctx->md);
+	if (ctx->ref_free)
+		ctx->ref_free(ctx, ctx->ref);
+	ctx->alloc.free(ctx->alloc.opaque, ctx);
+}
+
+const char *
+doctxt_strerror(int err)
+{
+	static const char *msg[] = {
+		[DOCTXT_OK]        = "success",
+		[DOCTXT_ENOMEM]    = "out of memory",
+		[DOCTXT_EINVAL]    = "invalid argument",
+		[DOCTXT_EZIP]      = "not a readable zip archive",
+		[DOCTXT_ENOPART]   = "required part missing from archive",
+		[DOCTXT_EXML]      = "malformed XML",
+		[DOCTXT_EMARKDOWN] = "markdown parse error",
+		[DOCTXT_EIO]       = "I/O error",
+	};
+
+	if (err < 0 || (size_t)err >= sizeof(msg) / sizeof(msg[0]))
+		return "unknown error";
+	return msg[err];
+}
+
+const char *
+doctxt_errmsg(const doctxt_ctx *ctx)
+{
+	return ctx->errmsg[0] ? ctx->errmsg : doctxt_strerror(ctx->err);
+}
+
+/* reset the per-conversion state; the output buffer and the arena blocks
+ * are kept for reuse */
+void
+dt_begin(doctxt_ctx *ctx)
+{
+	ctx->arena_cur = ctx->arena;
+	if (ctx->arena)
+		ctx->arena->used = 0;
+	ctx->outlen = 0;
+	ctx->err = DOCTXT_OK;
+	ctx->errmsg[0] = '\0';
+}
+
+/* hand out the result of a conversion; a failed conversion rolls its
+ * partial output back so callers never see half a document */
+int
+dt_end(doctxt_ctx *ctx, const char **out, size_t *outsize)
+{
+	out_write(ctx, "", 0);  /* empty results still get a buffer */
+	if (ctx->err) {
+		ctx->outlen = 0;
+		*out = NULL;
+		*outsize = 0;
+		return ctx->err;
+	}
+	*out = ctx->out;
+	*outsize = ctx->outlen;
+	return DOCTXT_OK;
+}
+
+/* record the first error of a conversion and return it */
+int
+dt_error(doctxt_ctx *ctx, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ctx->err)
+		return ctx->err;
+	ctx->err = err;
+	if (fmt) {
+		va_start(ap, fmt);
+		vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+		va_end(ap);
+	}
+	return err;
+}
+
+void *
+dt_malloc(doctxt_ctx *ctx, size_t len)
+{
+	void *p;
+
+	if (!(p = ctx->alloc.malloc(ctx->alloc.opaque, len)))
+		dt_error(ctx, DOCTXT_ENOMEM, NULL);
+	return p;
+}
+
+void *
+dt_realloc(doctxt_ctx *ctx, void *p, size_t len)
+{
+	void *n;
+
+	if (!(n = ctx->alloc.realloc(ctx->alloc.opaque, p, len)))
+		dt_error(ctx, DOCTXT_ENOMEM, NULL);
+	return n;
+}
+
+void
+dt_free(doctxt_ctx *ctx, void *p)
+{
+	if (p)
+		ctx->alloc.free(ctx->alloc.opaque, p);
+}
+
+void *
+arena_alloc(doctxt_ctx *ctx, size_t len)
+{
+	struct dt_block *b, *n;
+	size_t size;
+
+	len = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	for (b = ctx->arena_cur; b && b->size - b->used < len; ) {
+		if ((b = b->next))
+			b->used = 0;
+	}
+	if (!b) {
+		size = ctx->arena_cur ? MIN(ctx->arena_cur->size * 2, ARENA_MAX) : ARENA_MIN;
+		size = MAX(size, len);
+		if (!(n = dt_malloc(ctx, sizeof(*n) + size)))
+			return NULL;
+		n->size = size;
+		n->used = 0;
+		if (ctx->arena_cur) {
+			n->next = ctx->arena_cur->next;
+			ctx->arena_cur->next = n;
+		} else {
+			n->next = ctx->arena;
+			ctx->arena = n;
+		}
+		b = n;
+	}
+	ctx->arena_cur = b;
+	b->used += len;
+	return (char *)b->data + b->used - len;
+}
+
+/* resize the arena allocation p of oldlen bytes; the most recent
+ * allocation grows in place */
+void *
+arena_grow(doctxt_ctx *ctx, void *p, size_t oldlen, size_t len)
+{
+	struct dt_block *b = ctx->arena_cur;
+	size_t old = (oldlen + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	size_t new = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	void *n;
+
+	if (p && len <= oldlen)
+		return p;
+	if (p && b && (char *)p + old == (char *)b->data + b->used &&
+	    new - old <= b->size - b->used) {
+		b->used += new - old;
+		return p;
+	}
+	if ((n = arena_alloc(ctx, len)) && p)
+		memcpy(n, p, MIN(oldlen, len));
+	return n;
+}
+
+char *
+arena_strdup(doctxt_ctx *ctx, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if ((p = arena_alloc(ctx, len)))
+		memcpy(p, s, len);
+	return p;
+}
+
+/* extract archive entry i into a NUL-terminated arena buffer */
+char *
+dt_zip_entry(doctxt_ctx *ctx, mz_zip_archive *zip, int i, size_t *size)
+{
+	mz_zip_archive_file_stat st;
+	char *buf;
+
+	if (!mz_zip_reader_file_stat(zip, i, &st) || st.m_uncomp_size >= (size_t)-1) {
+		dt_error(ctx, DOCTXT_EZIP, "Failed to extract entry %d", i);
+		return NULL;
+	}
+	if (!(buf = arena_alloc(ctx, st.m_uncomp_size + 1)))
+		return NULL;
+	if (!mz_zip_reader_extract_to_mem(zip, i, buf, st.m_uncomp_size, 0)) {
+		dt_error(ctx, DOCTXT_EZIP, "Failed to extract %s", st.m_filename);
+		return NULL;
+	}
+	buf[st.m_uncomp_size] = '\0';
+	*size = st.m_uncomp_size;
+	return buf;
+}
+
+/* extract part name; returns NULL without recording an error when the
+ * archive has no such part */
+char *
+dt_zip_part(doctxt_ctx *ctx, mz_zip_archive *zip, const char *name, size_t *size)
+{
+	int i;
+
+	if ((i = mz_zip_reader_locate_file(zip, name, NULL, 0)) < 0)
+		return NULL;
+	return dt_zip_entry(ctx, zip, i, size);
+}
+
+/* parse xml in place into arena nodes; returns NULL on malformed XML,
+ * leaving it to the caller whether that is an error */
+struct txml_node *
+dt_parse_xml(doctxt_ctx *ctx, char *xml, size_t size)
+{
+	struct txml_node *nodes;
+	size_t i, n = 3;
+	_Bool malformed;
+
+	/* every start tag and every attribute is a node, and so is at most one
+	 * text node before each '<' and after the last one, plus txml's root
+	 * and end markers; counting beats guessing and retrying */
+	for (i = 0; i < size; i++) {
+		if (xml[i] == '<')
+			n += i + 1 < size && xml[i + 1] != '/' ? 2 : 1;
+		else if (xml[i] == '=')
+			n++;
+	}
+	if (!(nodes = arena_alloc(ctx, n * sizeof(*nodes))))
+		return NULL;
+	if (txml_parse_ex(xml, n, nodes, &malformed))
+		return NULL;
+	return nodes;
+}
+
+void *
+dt_mz_alloc(void *opaque, size_t items, size_t size)
+{
+	return dt_malloc(opaque, items * size);
+}
+
+void *
+dt_mz_realloc(void *opaque, void *p, size_t items, size_t size)
+{
+	return dt_realloc(opaque, p, items * size);
+}
+
+void
+dt_mz_free(void *opaque, void *p)
+{
+	dt_free(opaque, p);
+}
+
+/* make room for len more output bytes plus a terminating NUL */
+static int
+out_reserve(doctxt_ctx *ctx, size_t len)
+{
+	size_t cap;
+	char *p;
+
+	if (ctx->err)
+		return 0;
+	if (ctx->outlen + len < ctx->outcap)
+		return 1;
+	for (cap = ctx->outcap ? ctx->outcap : 4096; ctx->outlen + len >= cap; cap *= 2)
+		;
+	if (!(p = dt_realloc(ctx, ctx->out, cap)))
+		return 0;
+	ctx->out = p;
+	ctx->outcap = cap;
+	return 1;
+}
+
+int
+out_write(doctxt_ctx *ctx, const void *data, size_t len)
+{
+	if (!out_reserve(ctx, len))
+		return 0;
+	memcpy(ctx->out + ctx->outlen, data, len);
+	ctx->outlen += len;
+	ctx->out[ctx->outlen] = '\0';
+	return 1;
+}
+
+int
+out_puts(doctxt_ctx *ctx, const char *s)
+{
+	return out_write(ctx, s, strlen(s));
+}
+
+int
+out_printf(doctxt_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || !out_reserve(ctx, n))
+		return 0;
+	va_start(ap, fmt);
+	vsnprintf(ctx->out + ctx->outlen, n + 1, fmt, ap);
+	va_end(ap);
+	ctx->outlen += n;
+	return 1;
+}
@@ -7,3 +7,68 @@
 void die(const char *fmt, ...);
 void *xmalloc(size_t len);
 void *ecalloc(size_t nmembm, size_t size);
+char *readfile(const char *path, size_t *len);
+int writefile(const char *path, const void *data, size_t len);
+const char *mapfile(const char *path, size_t *len, int *mapped);
+void unmapfile(const char *p, size_t len, int mapped);
+long dt_threads(const doctxt_ctx *ctx);
+
+/* library internals; include doctxt.h first */
+struct dt_block;
+
+struct doctxt_ctx {
+	doctxt_allocator alloc;
+	struct dt_block *arena; /* per-document allocations, see arena_alloc() */
+	struct dt_block *arena_cur;
+	char *out;              /* result of the last conversion */
+	size_t outlen;
+	size_t outcap;
+	int err;                /* sticky error of the running conversion */
+	char errmsg[256];
+	void *md;               /* md4c parser kept across documents */
+	void (*md_free)(void *md);
+	void *ref;              /* md2docx reference document */
+	void (*ref_free)(doctxt_ctx *ctx, void *ref);
+	char *xml;              /* md2docx XML buffer kept across documents */
+	size_t xmlcap;
+	char *cache_dir;        /* md2docx fragment and output cache, or NULL */
+	long long mtime;        /* md2docx part dates, 0 for the current time */
+	char *image_dir;        /* md2docx images only from below here, or NULL */
+	int threads;            /* chunk threads per document, 0 for the default */
+	char *link_dir;         /* docx2md shared media links, or NULL */
+};
+
+void *dt_malloc(doctxt_ctx *ctx, size_t len);
+void *dt_realloc(doctxt_ctx *ctx, void *p, size_t len);
+void dt_free(doctxt_ctx *ctx, void *p);
+int dt_error(doctxt_ctx *ctx, int err, const char *fmt, ...);
+void dt_begin(doctxt_ctx *ctx);
+int dt_end(doctxt_ctx *ctx, const char **out, size_t *outsize);
+
+/* per-document arena: never freed individually, released by dt_begin() */
+void *arena_alloc(doctxt_ctx *ctx, size_t len);
+void *arena_grow(doctxt_ctx *ctx, void *p, size_t oldlen, size_t len);
+char *arena_strdup(doctxt_ctx *ctx, const char *s);
+
+/* docx parts, parsed in place from arena buffers; include miniz.h first */
+#ifdef MZ_VERSION
+char *dt_zip_entry(doctxt_ctx *ctx, mz_zip_archive *zip, int i, size_t *size);
+char *dt_zip_part(doctxt_ctx *ctx, mz_zip_archive *zip, const char *name,
+                  size_t *size);
+#endif
+struct txml_node;
+struct txml_node *dt_parse_xml(doctxt_ctx *ctx, char *xml, size_t size);
+
+/* miniz allocator callbacks, opaque is the doctxt_ctx */
+void *dt_mz_alloc(void *opaque, size_t items, size_t size);
+void *dt_mz_realloc(void *opaque, void *p, size_t items, size_t size);
+void dt_mz_free(void *opaque, void *p);
+#define DT_ZIP_ALLOC(zip, ctx)  ((zip)->m_pAlloc = dt_mz_alloc, \
+                                 (zip)->m_pRealloc = dt_mz_realloc, \
+                                 (zip)->m_pFree = dt_mz_free, \
+                                 (zip)->m_pAlloc_opaque = (ctx))
+
+/* conversion output, collected in ctx->out */
+int out_write(doctxt_ctx *ctx, const void *data, size_t len);
+int out_puts(doctxt_ctx *ctx, const char *s);
+int out_printf(doctxt_ctx *ctx, const char *fmt, ...);